@@ -0,0 +1,409 @@
+// Benchmarks. Generates LC-3 images for a few synthetic workloads, runs each
+// of them through run() on a fresh machine and reports instructions, address
+// translations and context switches per second. Build it with the feature
+// flags to measure, e.g. make bench CFLAGS="-std=c11 -Wall -DVM_DCACHE".
+//
+// usage: bench [-n scale] [-p procs] [-r repeat] [workload ...]
+//
+//   alu     tight register-only loop, scale iterations
+//   stride  reads and writes every 16th word of all the pages BRK can add,
+//           scale / 1000 passes
+//   yield   procs processes that YIELD to each other scale / procs times each
+//   churn   allocates, touches and frees a heap page with BRK scale / 100 times
+//   range   the same for RANGE_PAGES pages at a time with the ranged BRK
+//
+// Every workload runs repeat times and the fastest run is reported. A run
+// that leaves a wrong result in its result register fails the benchmark.
+#define _POSIX_C_SOURCE 200809L
+#define VM_HARNESS  // One machine per thread, output to vm_out
+#define VM_BENCH    // Instruction and switch counters
+#include "vm.c"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADDI(dr, sr, imm)  (0x1000 | (dr) << 9 | (sr) << 6 | 0x20 | ((imm) & 0x1f))
+#define ADDR(dr, s1, s2)   (0x1000 | (dr) << 9 | (s1) << 6 | (s2))
+#define ANDI(dr, sr, imm)  (0x5000 | (dr) << 9 | (sr) << 6 | 0x20 | ((imm) & 0x1f))
+#define LDR(dr, br, off)   (0x6000 | (dr) << 9 | (br) << 6 | ((off) & 0x3f))
+#define STR(sr, br, off)   (0x7000 | (sr) << 9 | (br) << 6 | ((off) & 0x3f))
+#define TRAP(v)            (0xf000 | (v))
+#define BR_P               (1)
+#define BR_NZP             (7)
+#define MAX_COUNT          (0x7fff)  // Largest loop count BRp still sees as positive
+
+#define BRK_VPN    (HEAP_VPN + HEAP_INIT_SIZE)  // First page BRK can add
+#define BRK_PAGES  (VPN_COUNT - BRK_VPN)
+#define RANGE_PAGES  (BRK_PAGES < 8 ? BRK_PAGES : 8)
+
+#define POOL       (2)  // Index of the first constant, after the branch over the pool
+
+typedef struct {
+    uint16_t w[HEAP_START - CODE_START];
+    int n;
+    uint16_t heap[4];  // Start of the heap image, the rest is zero
+} image;
+
+// Starts an image with a branch over a pool of count constants, set with
+// image_const() and loaded with emit_ld(). The condition codes start out
+// clear, so an AND sets one for the branch to be taken.
+static void image_start(image *im, int count) {
+    memset(im, 0, sizeof(*im));
+    im->w[0] = ANDI(0, 0, 0);
+    im->w[1] = BR_NZP << 9 | count;
+    im->n = POOL + count;
+}
+
+static void image_const(image *im, int k, uint16_t v) {
+    im->w[POOL + k] = v;
+}
+
+static void emit(image *im, uint16_t w) {
+    im->w[im->n++] = w;
+}
+
+static void emit_ld(image *im, int dr, int k) {
+    emit(im, 0x2000 | dr << 9 | ((POOL + k - (im->n + 1)) & 0x1ff));
+}
+
+// Branches back to the instruction at index target
+static void emit_br(image *im, int nzp, int target) {
+    emit(im, nzp << 9 | ((target - (im->n + 1)) & 0x1ff));
+}
+
+static uint16_t clamp_count(long n) {
+    return n < 1 ? 1 : n > MAX_COUNT ? MAX_COUNT : n;
+}
+
+// Splits iterations into the counts of two nested loops
+static void loop_counts(long iterations, uint16_t *outer, uint16_t *inner) {
+    *inner = clamp_count(iterations < 1000 ? iterations : 1000);
+    *outer = clamp_count((iterations + *inner - 1) / *inner);
+}
+
+// Two nested counting loops, R5 counting the outer and R4 the inner one, that
+// run their body about iterations times. Constants k and k + 1 hold the
+// counts. loop_begin() returns the index of the body for loop_end().
+static int loop_begin(image *im, int k, long iterations, int *outer) {
+    uint16_t n_outer, n_inner;
+    loop_counts(iterations, &n_outer, &n_inner);
+    image_const(im, k, n_outer);
+    image_const(im, k + 1, n_inner);
+    emit_ld(im, 5, k);
+    *outer = im->n;
+    emit_ld(im, 4, k + 1);
+    return im->n;
+}
+
+static void loop_end(image *im, int body, int outer) {
+    emit(im, ADDI(4, 4, -1));
+    emit_br(im, BR_P, body);
+    emit(im, ADDI(5, 5, -1));
+    emit_br(im, BR_P, outer);
+}
+
+// scale iterations of three ALU instructions and the loop counting. R1 ends
+// up with the sum of the iteration numbers.
+static void gen_alu(image *im, long scale, int procs) {
+    int outer;
+    image_start(im, 2);
+    int body = loop_begin(im, 0, scale, &outer);
+    emit(im, ADDR(1, 1, 2));
+    emit(im, ADDI(2, 2, 1));
+    emit(im, ANDI(3, 1, 7));
+    loop_end(im, body, outer);
+    emit(im, TRAP(0x25));
+}
+
+// Maps every page BRK can add, then walks them with a stride of 16 words,
+// incrementing each word it visits. R3 ends up with the number of passes.
+static void gen_stride(image *im, long scale, int procs) {
+    int stride = 16;
+    image_start(im, BRK_PAGES + 4);
+    for (int p = 0; p < BRK_PAGES; p++) {
+        image_const(im, p, (BRK_VPN + p) << PAGE_SHIFT | 0x7);  // Allocate, readable, writable
+    }
+    image_const(im, BRK_PAGES, BRK_VPN << PAGE_SHIFT);
+    image_const(im, BRK_PAGES + 1, clamp_count((long)BRK_PAGES * PAGE_WORDS / stride));
+    image_const(im, BRK_PAGES + 2, clamp_count(scale / 1000));
+    image_const(im, BRK_PAGES + 3, stride);
+    for (int p = 0; p < BRK_PAGES; p++) {
+        emit_ld(im, 0, p);
+        emit(im, TRAP(0x29));
+    }
+    emit_ld(im, 6, BRK_PAGES + 3);
+    emit_ld(im, 5, BRK_PAGES + 2);
+    int outer = im->n;
+    emit_ld(im, 2, BRK_PAGES);
+    emit_ld(im, 4, BRK_PAGES + 1);
+    int loop = im->n;
+    emit(im, LDR(3, 2, 0));
+    emit(im, ADDI(3, 3, 1));
+    emit(im, STR(3, 2, 0));
+    emit(im, ADDR(2, 2, 6));
+    emit(im, ADDI(4, 4, -1));
+    emit_br(im, BR_P, loop);
+    emit(im, ADDI(5, 5, -1));
+    emit_br(im, BR_P, outer);
+    emit(im, TRAP(0x25));
+}
+
+// A loop that yields on every iteration. Unless the build keeps registers per
+// process the processes share them, so the loop counts live in the heap: the
+// inner count, the outer count and the value the inner one restarts from. R1
+// counts the iterations, of every process when the registers are shared.
+static void gen_yield(image *im, long scale, int procs) {
+    image_start(im, 1);
+    image_const(im, 0, HEAP_START);
+    loop_counts(scale / procs, &im->heap[1], &im->heap[0]);
+    im->heap[2] = im->heap[0];
+    emit_ld(im, 2, 0);
+    int loop = im->n;
+    emit(im, ADDI(1, 1, 1));
+    emit(im, TRAP(0x28));
+    emit(im, LDR(4, 2, 0));
+    emit(im, ADDI(4, 4, -1));
+    emit(im, STR(4, 2, 0));
+    emit_br(im, BR_P, loop);
+    emit(im, LDR(4, 2, 2));
+    emit(im, STR(4, 2, 0));
+    emit(im, LDR(5, 2, 1));
+    emit(im, ADDI(5, 5, -1));
+    emit(im, STR(5, 2, 1));
+    emit_br(im, BR_P, loop);
+    emit(im, TRAP(0x25));
+}
+
+// Allocates a page, writes the inner loop count to it and frees it again. R3
+// sums the counts read back from the page.
+static void gen_churn(image *im, long scale, int procs) {
+    int outer;
+    image_start(im, 4);
+    image_const(im, 2, BRK_VPN << PAGE_SHIFT | 0x7);  // Allocate, readable, writable
+    image_const(im, 3, BRK_VPN << PAGE_SHIFT);
+    int body = loop_begin(im, 0, scale / 100, &outer);
+    emit_ld(im, 0, 2);
+    emit(im, TRAP(0x29));
+    emit_ld(im, 2, 3);
+    emit(im, STR(4, 2, 0));
+    emit(im, LDR(0, 2, 0));
+    emit(im, ADDR(3, 3, 0));
+    emit_ld(im, 0, 3);
+    emit(im, TRAP(0x29));
+    loop_end(im, body, outer);
+    emit(im, TRAP(0x25));
+}
+
+// Allocates RANGE_PAGES pages with one trap, writes the inner loop count to
+// each and frees them again. R3 sums the counts read back from the pages.
+static void gen_range(image *im, long scale, int procs) {
+    int outer;
+    image_start(im, 6);
+    image_const(im, 2, BRK_VPN << PAGE_SHIFT | 0x7);  // Allocate, readable, writable
+    image_const(im, 3, BRK_VPN << PAGE_SHIFT);
+    image_const(im, 4, RANGE_PAGES);
+    image_const(im, 5, PAGE_WORDS);
+    emit_ld(im, 1, 4);
+    emit_ld(im, 6, 5);
+    int body = loop_begin(im, 0, scale / 100, &outer);
+    emit_ld(im, 0, 2);
+    emit(im, TRAP(0x2b));
+    emit_ld(im, 2, 3);
+    for (int p = 0; p < RANGE_PAGES; p++) {
+        emit(im, STR(4, 2, 0));
+        emit(im, LDR(0, 2, 0));
+        emit(im, ADDR(3, 3, 0));
+        emit(im, ADDR(2, 2, 6));
+    }
+    emit_ld(im, 0, 3);
+    emit(im, TRAP(0x2b));
+    loop_end(im, body, outer);
+    emit(im, TRAP(0x25));
+}
+
+// Expected results. The registers start out zero and wrap around at 16 bits.
+static uint16_t result_alu(long scale, int procs) {
+    uint16_t outer, inner;
+    loop_counts(scale, &outer, &inner);
+    uint64_t n = (uint64_t)outer * inner;
+    return n * (n - 1) / 2;
+}
+
+static uint16_t result_stride(long scale, int procs) {
+    return clamp_count(scale / 1000);
+}
+
+static uint16_t result_yield(long scale, int procs) {
+    uint16_t outer, inner;
+    loop_counts(scale / procs, &outer, &inner);
+#if defined(VM_PREEMPT)
+    procs = 1;  // Only the registers of the process that halted last are left
+#endif
+    return (uint64_t)outer * inner * procs;
+}
+
+static uint16_t result_churn(long scale, int procs) {
+    uint16_t outer, inner;
+    loop_counts(scale / 100, &outer, &inner);
+    return (uint64_t)outer * inner * (inner + 1) / 2;
+}
+
+static uint16_t result_range(long scale, int procs) {
+    return result_churn(scale, procs) * RANGE_PAGES;
+}
+
+typedef struct {
+    const char *name;
+    void (*gen)(image *im, long scale, int procs);
+    bool multi;  // Runs procs processes, one otherwise
+    int reg;     // Register holding the result once every process halted
+    uint16_t (*result)(long scale, int procs);
+} workload;
+
+workload workloads[] = {
+    {"alu", gen_alu, false, R1, result_alu},
+    {"stride", gen_stride, false, R3, result_stride},
+    {"yield", gen_yield, true, R1, result_yield},
+    {"churn", gen_churn, false, R3, result_churn},
+    {"range", gen_range, false, R3, result_range},
+};
+
+typedef struct {
+    char *code;
+    char *heap;
+    int procs;
+    int reg;
+    uint16_t result;
+    double secs;
+    uint64_t insns;
+    uint64_t translations;
+    uint64_t switches;
+} bench_run;
+
+static void write_words(const char *path, const uint16_t *w, int n) {
+    FILE *f = fopen(path, "wb");
+    if (NULL == f || fwrite(w, sizeof(uint16_t), n, f) != (size_t)n) {
+        fprintf(stderr, "Cannot write to file %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+}
+
+// Runs one workload on the fresh machine of a new thread
+static void *bench_thread(void *arg) {
+    bench_run *b = arg;
+    vm_out = fopen("/dev/null", "w");
+    if (NULL == vm_out) {
+        fprintf(stderr, "Cannot open file /dev/null.\n");
+        exit(1);
+    }
+    initOS();
+    for (int p = 0; p < b->procs; p++) {
+        createProc(b->code, b->heap);
+    }
+    loadProc(0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run(b->code, b->heap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    b->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    b->insns = insn_count;
+    b->translations = tlb_hits + tlb_misses;
+    b->switches = switch_count;
+    b->result = reg[b->reg];
+    fclose(vm_out);
+    vm_release();
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long scale = 1000000;
+    int procs = 4;
+    int repeat = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:r:")) != -1) {
+        switch (opt) {
+            case 'n': scale = atol(optarg); break;
+            case 'p': procs = atoi(optarg); break;
+            case 'r': repeat = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n scale] [-p procs] [-r repeat] [workload ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (procs < 1 || procs > MAX_PROCS) {
+        fprintf(stderr, "The number of processes must be between 1 and %d.\n", MAX_PROCS);
+        return 2;
+    }
+    if (repeat < 1) {
+        repeat = 1;
+    }
+    int count = sizeof(workloads) / sizeof(workloads[0]);
+    for (int a = optind; a < argc; a++) {
+        bool known = false;
+        for (int w = 0; w < count; w++) {
+            known |= strcmp(argv[a], workloads[w].name) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "Unknown workload %s.\n", argv[a]);
+            return 2;
+        }
+    }
+
+    char dir[] = "/tmp/vm-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "Cannot create a directory for the images.\n");
+        return 1;
+    }
+    char code[sizeof(dir) + 16], heap[sizeof(dir) + 16];
+    snprintf(code, sizeof(code), "%s/code.obj", dir);
+    snprintf(heap, sizeof(heap), "%s/heap.obj", dir);
+
+    bool failed = false;
+    fprintf(stdout, "%-8s %5s %12s %12s %9s %10s %10s %10s\n", "workload", "procs", "insns", "switches",
+            "seconds", "Minsn/s", "Mxlate/s", "switch/s");
+    for (int w = 0; w < count; w++) {
+        bool selected = optind == argc;
+        for (int a = optind; a < argc; a++) {
+            selected |= strcmp(argv[a], workloads[w].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        image im;
+        int n = workloads[w].multi ? procs : 1;
+        workloads[w].gen(&im, scale, n);
+        write_words(code, im.w, im.n);
+        write_words(heap, im.heap, sizeof(im.heap) / sizeof(im.heap[0]));
+
+        uint16_t expect = workloads[w].result(scale, n);
+        bench_run best = {NULL};
+        for (int r = 0; r < repeat; r++) {
+            bench_run b = {code, heap, n, workloads[w].reg};
+            pthread_t t;
+            if (pthread_create(&t, NULL, bench_thread, &b) != 0) {
+                fprintf(stderr, "Cannot create benchmark thread.\n");
+                return 1;
+            }
+            pthread_join(t, NULL);
+            if (b.result != expect) {
+                fprintf(stderr, "Workload %s computed %d instead of %d.\n", workloads[w].name, b.result, expect);
+                failed = true;
+            }
+            if (r == 0 || b.secs < best.secs) {
+                best = b;
+            }
+        }
+        double secs = best.secs > 0 ? best.secs : 1e-9;
+        fprintf(stdout, "%-8s %5d %12llu %12llu %9.4f %10.2f %10.2f %10.0f\n", workloads[w].name, n,
+                (unsigned long long)best.insns, (unsigned long long)best.switches, best.secs,
+                best.insns / secs / 1e6, best.translations / secs / 1e6, best.switches / secs);
+    }
+    remove(code);
+    remove(heap);
+    rmdir(dir);
+    return failed;
+}
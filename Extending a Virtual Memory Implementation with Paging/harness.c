@@ -0,0 +1,204 @@
+// Batch harness. Runs the scenarios of a manifest in one host process, each
+// on its own machine (see VM_HARNESS in vm.c) on a pool of threads, compares
+// the output of every run with its golden file and reports the throughput.
+//
+// usage: harness [-j threads] [-r repeat] manifest
+//
+// A manifest line holds a golden output file followed by the code and heap
+// images of the processes, as they are passed to ./vm. Blank lines and lines
+// starting with '#' are skipped. -r runs the whole manifest that many times.
+#define _POSIX_C_SOURCE 200809L
+#define VM_HARNESS
+#define main vm_main
+#include "main.c"
+#undef main
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ARGS (2 * MAX_PROCS + 1)
+
+typedef struct {
+    char *golden;              // Path of the expected output
+    char *expect;              // Its contents
+    size_t expect_len;
+    int argc;
+    char *argv[MAX_ARGS + 1];  // argv[0] is the program name, as for ./vm
+    int failures;
+} scenario;
+
+scenario *scenarios = NULL;
+int scenario_count = 0;
+long jobs = 0;                   // scenario_count times the repeat count
+long next_job = 0;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards next_job and the failure counts
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (NULL == f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc(size + 1);
+    *len = fread(buf, 1, size, f);
+    buf[*len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+// Reads the manifest into scenarios. Returns 0 if it or a file it names
+// cannot be read.
+static int load_manifest(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (NULL == f) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return 0;
+    }
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *tok = strtok(line, " \t\r\n");
+        if (tok == NULL || tok[0] == '#') {
+            continue;
+        }
+        scenarios = realloc(scenarios, (scenario_count + 1) * sizeof(scenario));
+        scenario *s = &scenarios[scenario_count++];
+        memset(s, 0, sizeof(*s));
+        s->golden = strcpy(malloc(strlen(tok) + 1), tok);
+        s->argv[s->argc++] = "vm";
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+            if (s->argc == MAX_ARGS) {
+                fprintf(stderr, "%s:%d: too many images.\n", path, lineno);
+                fclose(f);
+                return 0;
+            }
+            if (access(tok, R_OK) != 0) {  // The VM exits on a missing image
+                fprintf(stderr, "%s:%d: cannot open file %s.\n", path, lineno, tok);
+                fclose(f);
+                return 0;
+            }
+            s->argv[s->argc++] = strcpy(malloc(strlen(tok) + 1), tok);
+        }
+        if (s->argc < 3 || s->argc % 2 == 0) {
+            fprintf(stderr, "%s:%d: expected a golden file and code/heap image pairs.\n", path, lineno);
+            fclose(f);
+            return 0;
+        }
+        s->expect = read_file(s->golden, &s->expect_len);
+        if (s->expect == NULL) {
+            fprintf(stderr, "%s:%d: cannot open file %s.\n", path, lineno, s->golden);
+            fclose(f);
+            return 0;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// Runs one scenario. It gets a thread of its own so that it starts from the
+// zeroed machine a new process would.
+static void *run_scenario(void *arg) {
+    scenario *s = arg;
+    char *out = NULL;
+    size_t len = 0;
+    vm_out = open_memstream(&out, &len);
+    if (NULL == vm_out) {
+        fprintf(stderr, "Cannot allocate the output buffer.\n");
+        exit(1);
+    }
+    vm_main(s->argc, s->argv);
+    fclose(vm_out);
+    vm_release();
+
+    if (len != s->expect_len || memcmp(out, s->expect, len) != 0) {
+        pthread_mutex_lock(&job_lock);
+        s->failures++;
+        pthread_mutex_unlock(&job_lock);
+    }
+    free(out);
+    return NULL;
+}
+
+static void *pool_worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        long job = next_job < jobs ? next_job++ : -1;
+        pthread_mutex_unlock(&job_lock);
+        if (job == -1) {
+            return NULL;
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, run_scenario, &scenarios[job % scenario_count]) != 0) {
+            fprintf(stderr, "Cannot create scenario thread.\n");
+            exit(1);
+        }
+        pthread_join(t, NULL);
+    }
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:r:")) != -1) {
+        switch (opt) {
+            case 'j': threads = atol(optarg); break;
+            case 'r': repeat = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-j threads] [-r repeat] manifest\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-j threads] [-r repeat] manifest\n", argv[0]);
+        return 2;
+    }
+    if (!load_manifest(argv[optind])) {
+        return 2;
+    }
+    if (scenario_count == 0) {
+        fprintf(stderr, "No scenarios in %s.\n", argv[optind]);
+        return 2;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (repeat < 1) {
+        repeat = 1;
+    }
+    jobs = scenario_count * repeat;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    for (long t = 0; t < threads; t++) {
+        if (pthread_create(&pool[t], NULL, pool_worker, NULL) != 0) {
+            fprintf(stderr, "Cannot create worker thread.\n");
+            return 1;
+        }
+    }
+    for (long t = 0; t < threads; t++) {
+        pthread_join(pool[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(pool);
+
+    long failed = 0;
+    for (int i = 0; i < scenario_count; i++) {
+        scenario *s = &scenarios[i];
+        fprintf(stdout, "%s %s", s->failures ? "FAIL" : "PASS", s->golden);
+        if (s->failures) {
+            fprintf(stdout, " (%d of %ld runs)", s->failures, repeat);
+        }
+        fprintf(stdout, "\n");
+        failed += s->failures;
+    }
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stdout, "%ld runs, %ld failed, %ld threads, %.3f s, %.0f runs/s\n",
+            jobs, failed, threads, secs, secs > 0 ? jobs / secs : 0.0);
+    return failed != 0;
+}
@@ -1,21 +1,37 @@
 #include "vm.c"
 
 int main(int argc, char **argv) {
-    initOS();
-    for (int i = 1; i < argc; i += 2) {
-        createProc(argv[i], argv[i+1]);
+#ifdef VM_MMAP
+    img_preload(argv + 1, argc - 1);  // Map every image before the processes are created
+#endif
+    char *restore = getenv("VM_RESTORE");  // Start from a snapshot instead of the images
+    if (restore != NULL) {
+        if (!vm_restore(restore)) {
+            return 1;
+        }
+    } else {
+        initOS();
+        for (int i = 1; i < argc; i += 2) {
+            createProc(argv[i], argv[i+1]);
+        }
+    }
+    char *snapshot = getenv("VM_SNAPSHOT");  // Also rewritten by each checkpoint trap
+    if (snapshot != NULL) {
+        vm_snapshot(snapshot);
     }
 
-    fprintf(stdout, "Occupied memory after program load:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);
+    fprintf(vm_out, "Occupied memory after program load:\n");
+    fprintf_mem_pages(vm_out, mem, MEM_WORDS, PAGE_WORDS, frame_in_use);
     uint16_t currentProc = 0;
-    loadProc(currentProc);
-    fprintf_reg_all(stdout, reg, RCNT);
-    fprintf(stdout, "program execution starts.\n");
+    if (mem[0] == 0xffff) {  // Otherwise a restored snapshot was taken mid-run
+        loadProc(currentProc);
+    }
+    fprintf_reg_all(vm_out, reg, RCNT);
+    fprintf(vm_out, "program execution starts.\n");
     run(argv[1], argv[2]);
-    fprintf(stdout, "program execution ends.\n");
-    fprintf(stdout, "Occupied memory after program execution:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);   
-    fprintf_reg_all(stdout, reg, RCNT);
+    fprintf(vm_out, "program execution ends.\n");
+    fprintf(vm_out, "Occupied memory after program execution:\n");
+    fprintf_mem_pages(vm_out, mem, MEM_WORDS, PAGE_WORDS, frame_in_use);   
+    fprintf_reg_all(vm_out, reg, RCNT);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,25 @@
+#define VM_DEMAND
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/brk_code.obj", "programs/brk_heap.obj");
+    loadProc(0);
+    reg[R0] = 0x4000 | 0x7;                   // BRK on the first heap page, reserved but not loaded yet
+    tbrk();
+    fprintf(stdout, "Heap word: %d, page faults: %d\n", mr(0x4000), (int)page_faults);
+    reg[R0] = 0x4800 | 0x7;                   // the second one is resident now
+    mr(0x4800);
+    tbrk();
+    reg[R0] = 0x5000 | 0x7;                   // a page the process does not have yet
+    tbrk();
+    mw(0x5000, 9);
+    fprintf(stdout, "New page word: %d, page faults: %d\n", mr(0x5000), (int)page_faults);
+    reg[R0] = 0x3800 | 0x7;                   // a shared region over the reserved second code page
+    reg[R1] = 3;
+    reg[R2] = 1;
+    tshm();
+    fprintf(stdout, "R0: %d, still lazy: %d\n", reg[R0], (mem[PTE_ADDR(4096, 7)] & PTE_LAZY) != 0);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    reg[R0] = (10 << 11) | 0x7;               // pages 10-13, read-write
+    reg[R1] = 4;
+    tbrkn();                                  // one run of four frames
+    for (int vpn = 10; vpn < 14; vpn++) {
+        mw(vpn << 11, vpn);
+    }
+    fprintf(stdout, "Occupied memory after a ranged increase:\n");
+    fprintf_mem_nonzero(stdout, mem, 4128);
+    reg[R0] = (12 << 11) | 0x7;               // page 12 is taken, nothing is mapped
+    reg[R1] = 3;
+    tbrkn();
+    reg[R0] = (30 << 11) | 0x7;               // runs past the address space
+    tbrkn();
+
+    for (int vpn = 0; vpn < 21; vpn++) {
+        allocMem(4128, vpn, UINT16_MAX, UINT16_MAX);  // every free frame is taken now
+    }
+    freeMem(3, 4128);
+    freeMem(5, 4128);                         // two frames with a gap between them
+    reg[R0] = (20 << 11) | 0x3;               // no run of three is left
+    reg[R1] = 3;
+    tbrkn();
+    fprintf(stdout, "Free frames after a failed increase: %d\n", free_frames);
+    reg[R1] = 2;
+    tbrkn();                                  // the two single frames
+    fprintf(stdout, "Occupied memory after a split increase:\n");
+    fprintf_mem_nonzero(stdout, mem, 4128);
+    reg[R0] = 10 << 11;                       // pages 14-19 are not allocated
+    reg[R1] = 12;
+    tbrkn();
+    fprintf(stdout, "Free frames after a ranged decrease: %d\n", free_frames);
+    fprintf_mem_nonzero(stdout, mem, OS_FREE_BITMAP + OS_BITMAP_WORDS);
+
+    return 0;
+}
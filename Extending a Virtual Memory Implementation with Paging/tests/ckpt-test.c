@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+#define VM_PREEMPT
+#include "../vm.c"
+
+// Prints base + 6 .. base + 1 with base read from the heap, and takes a
+// checkpoint after printing base + 4
+uint16_t code[] = {
+    0x260c,  // LD R3,#12     R3 = 0x4000
+    0x64c0,  // LDR R2,R3,#0  R2 = base
+    0x5260,  // AND R1,R1,#0
+    0x1266,  // ADD R1,R1,#6
+    0x1081,  // ADD R0,R2,R1
+    0xf027,  // TRAP x27      OUTU16
+    0x127f,  // ADD R1,R1,#-1
+    0x187d,  // ADD R4,R1,#-3
+    0x0a01,  // BRnp #1
+    0xf02f,  // TRAP x2F      checkpoint
+    0x1260,  // ADD R1,R1,#0
+    0x03f8,  // BRp #-8
+    0xf025,  // HALT
+    0x4000,
+};
+
+static void load() {
+    initOS();
+    for (uint16_t pid = 0; pid < 2; pid++) {
+        createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+        uint16_t pfn = PTE_PFN(mem[PTE_ADDR(PT_ADDR(pid), CODE_VPN)]);
+        memcpy(mem + FRAME_ADDR(pfn), code, sizeof(code));
+        loadProc(pid);
+        mw(0x4000, 100 * (pid + 1));
+    }
+    loadProc(0);
+    running = true;
+}
+
+static void report() {
+    fprintf(stdout, "ticks %llu, runtimes %llu %llu, waits %llu %llu\n", (unsigned long long)ticks,
+            (unsigned long long)proc_run[0], (unsigned long long)proc_run[1],
+            (unsigned long long)proc_wait[0], (unsigned long long)proc_wait[1]);
+}
+
+int main(int argc, char **argv) {
+    setenv("VM_QUANTUM", "7", 1);            // preempted in the middle of the loops
+
+    fprintf(stdout, "Uninterrupted run:\n");
+    load();
+    run(NULL, NULL);
+    report();
+
+    fprintf(stdout, "Run taking checkpoints:\n");
+    setenv("VM_SNAPSHOT", "tests/ckpt-test.snap", 1);
+    load();
+    run(NULL, NULL);
+    unsetenv("VM_SNAPSHOT");
+
+    fprintf(stdout, "Run restored from the last checkpoint:\n");
+    setenv("VM_QUANTUM", "1000", 1);         // the snapshot keeps the quantum it was taken with
+    fprintf(stdout, "Snapshot restored: %d\n", vm_restore("tests/ckpt-test.snap"));
+    fprintf(stdout, "R0 after the trap: %d\n", reg[R0]);
+    run(NULL, NULL);
+    report();
+    remove("tests/ckpt-test.snap");
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+#define VM_CONIO
+#include <pthread.h>
+#include <time.h>
+#include "../vm.c"
+
+static int input[2];
+
+// Input that arrives once the guests have run for a while
+static void *late_input(void *arg) {
+    struct timespec t = {0, 200000000};
+    nanosleep(&t, NULL);
+    write(input[1], "x", 1);
+    close(input[1]);
+    return NULL;
+}
+
+static void parse(const char *in, bool eof) {
+    int val = 0;
+    int n = con_parse_u16(in, strlen(in), eof, &val);
+    fprintf(stdout, "\"%s\": consumed %d, value %d\n", in, n, val);
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    mem[0] = 0;
+    reg[R0] = 'a';
+    tout();
+    reg[R0] = 513;
+    toutu16();
+    fprintf(stdout, "Buffered: %d\n", con_len[0]);  // Nothing written yet
+    CON_SYNC();
+    fprintf(stdout, "Buffered after sync: %d\n", con_len[0]);
+
+    parse(" 42 x", false);
+    parse("42", false);                               // The number may go on
+    parse("42", true);
+    parse("-1 ", false);
+    parse("  x1", false);
+
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    wait_key[1] = 1;                                  // A process in WAIT does not read the console
+    fprintf(stdout, "Others runnable: %d\n", con_others(0));
+    wait_key[1] = 0;
+    fprintf(stdout, "Others runnable after notify: %d\n", con_others(0));
+
+    memset(mem, 0, sizeof(mem));                      // initOS() keeps the page tables
+    initOS();
+    uint16_t reader[3] = {0xf020, 0xf021, 0xf025};          // GETC; OUT; HALT
+    uint16_t yielder[4] = {0xf028, 0xf028, 0xf028, 0xf025};  // YIELD three times; HALT
+    uint16_t *code[2] = {reader, yielder};
+    size_t size[2] = {sizeof(reader), sizeof(yielder)};
+    for (uint16_t pid = 0; pid < 2; pid++) {
+        createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+        uint16_t pfn = PTE_PFN(mem[PTE_ADDR(PT_ADDR(pid), CODE_VPN)]);
+        memcpy(mem + FRAME_ADDR(pfn), code[pid], size[pid]);
+    }
+    pipe(input);
+    dup2(input[0], STDIN_FILENO);
+    pthread_t writer;
+    pthread_create(&writer, NULL, late_input, NULL);
+    loadProc(0);
+    running = true;
+    run(NULL, NULL);                                  // the reader is not scheduled until the input came
+    pthread_join(writer, NULL);
+    fprintf(stdout, "\n");
+
+    return 0;
+}
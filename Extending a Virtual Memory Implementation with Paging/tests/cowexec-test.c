@@ -0,0 +1,21 @@
+#define VM_DCACHE
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    uint16_t pfn = PTE_PFN(mem[PTE_ADDR(4096, 8)]);
+    uint16_t code[3] = {0x3003, 0x1021, 0xf025};  // ST R0,#3; ADD R0,R0,#1; HALT
+    memcpy(mem + FRAME_ADDR(pfn), code, sizeof(code));
+    tfork();
+    loadProc(1);
+    thalt();                                  // the parent is the last sharer of its heap page
+    loadProc(0);
+    reg[RPC] = 0x4000;                        // runs the copy-on-write page, which writes to itself
+    reg[R0] = 5;
+    run(NULL, NULL);
+    fprintf(stdout, "R0: %d, stored: %d\n", reg[R0], mem[FRAME_ADDR(pfn) + 4]);
+
+    return 0;
+}
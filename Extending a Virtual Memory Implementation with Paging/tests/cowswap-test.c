@@ -0,0 +1,26 @@
+#define VM_SWAP
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    mw(0x4000, 42);
+    tfork();                                  // child 1 shares the heap frame
+    uint16_t pfn = PTE_PFN(mem[PTE_ADDR(4096, 8)]);
+    reg[PTBR] = PT_ADDR(2);
+    for (int vpn = 16; free_frames > 0; vpn++) {
+        allocMem(PT_ADDR(2), vpn, UINT16_MAX, UINT16_MAX);  // every free frame is taken now
+    }
+    clock_hand = pfn;                         // the shared frame is the next victim
+    mem[PTE_ADDR(4096, 8)] &= ~PTE_REF;
+    loadProc(1);
+    mw(0x4000, 7);                            // the copy needs a frame, another page is evicted
+    fprintf(stdout, "Shared frame kept: %d, refs: %d\n", PTE_PFN(mem[PTE_ADDR(4096, 8)]) == pfn, frame_ref[pfn]);
+    fprintf(stdout, "%d\n", mr(0x4000));
+    loadProc(0);
+    fprintf(stdout, "%d\n", mr(0x4000));
+    fprintf(stdout, "Evictions: %d\n", (int)evictions);
+
+    return 0;
+}
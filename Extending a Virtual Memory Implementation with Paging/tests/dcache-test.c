@@ -0,0 +1,45 @@
+#define VM_DCACHE
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    uint16_t pfn = PTE_PFN(mem[PTE_ADDR(4096, 6)]);
+    uint16_t code[2] = {0x1021, 0x6340};      // ADD R0,R0,#1; LDR R1,R5,#0 faults and stops run()
+    memcpy(mem + FRAME_ADDR(pfn), code, sizeof(code));
+    reg[R0] = reg[R5] = 0;
+    run(NULL, NULL);                          // the code page is decoded
+    fprintf(stdout, "R0: %d, decoded: %d\n", reg[R0], dcache[pfn] != NULL);
+
+    freeMem(6, 4096);                         // drops the decoded page
+    allocMem(4096, 6, UINT16_MAX, 0);
+    fprintf(stdout, "Same frame: %d, decoded: %d\n", PTE_PFN(mem[PTE_ADDR(4096, 6)]) == pfn, dcache[pfn] != NULL);
+    code[0] = 0x1022;                         // ADD R0,R0,#2
+    memcpy(mem + FRAME_ADDR(pfn), code, sizeof(code));
+    reg[R0] = 0;
+    reg[RPC] = 0x3000;
+    running = true;
+    run(NULL, NULL);                          // runs the new code, not the old decoded one
+    fprintf(stdout, "R0: %d\n", reg[R0]);
+
+    reg[R0] = 0x5000 | 0x3;                   // a shared region mapped read-only
+    reg[R1] = 1;
+    reg[R2] = 1;
+    tshm();
+    reg[R0] = 0x5800 | 0x7;                   // and writable
+    tshm();
+    uint16_t shm_code[4] = {0x78c2, 0x1020, 0x1021, 0xf025};  // STR R4,R3,#2; ADD R0,R0,#0; ADD R0,R0,#1; HALT
+    for (int k = 0; k < 4; k++) {
+        mw(0x5800 + k, shm_code[k]);
+    }
+    reg[R0] = 0;
+    reg[R3] = 0x5800;
+    reg[R4] = 0x1025;                         // ADD R0,R0,#5 over the third instruction
+    reg[RPC] = 0x5000;
+    running = true;
+    run(NULL, NULL);                          // the block rewrites itself through the writable mapping
+    fprintf(stdout, "R0: %d, shared frame decoded: %d\n", reg[R0], dcache[PTE_PFN(mem[PTE_ADDR(4096, 10)])] != NULL);
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#define VM_DEMAND
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    for (int p = 0; p < 8; p++) {
+        createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    }
+    fprintf(stdout, "Free frames after creating 8 processes: %d\n", (int)free_frames);
+    for (int vpn = CODE_VPN; free_frames > 0; vpn++) {
+        allocMem(PT_ADDR(8), vpn, UINT16_MAX, UINT16_MAX);  // every free frame is taken now
+    }
+    loadProc(0);
+    running = true;
+    uint16_t w = mr(0x3000);                  // the fault finds no frame
+    fprintf(stdout, "Read %d, running: %d, still lazy: %d\n", w, running, (mem[PTE_ADDR(4096, 6)] & PTE_LAZY) != 0);
+    freeMem(CODE_VPN, PT_ADDR(8));
+    running = true;
+    w = mr(0x3000);                           // loads the page from the image into the freed frame
+    fprintf(stdout, "Read 0x%04x, running: %d, free frames: %d\n", w, running, (int)free_frames);
+    fprintf(stdout, "Page faults: %d\n", (int)page_faults);
+
+    return 0;
+}
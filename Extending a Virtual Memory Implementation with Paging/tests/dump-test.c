@@ -0,0 +1,58 @@
+#include "../vm.c"
+
+// fprintf_mem_nonzero() as it was before the buffered formatter, one
+// fprintf() per field and bit
+static void dump_reference(FILE *f, uint16_t *m, uint32_t stop) {
+    for (uint32_t i = 0; i < stop; i++) {
+        if (m[i] != 0) {
+            fprintf(f, "mem[%u|0x%.04x]=", i, i);
+            for (int c = 15; c >= 0; c--) {
+                fprintf(f, "%s%d", (c + 1) % 4 == 0 ? " " : "", (m[i] >> c) & 1);
+            }
+            fprintf(f, " (dec: %d)\n", m[i]);
+        }
+    }
+}
+
+// Prints whether the buffered dump up to stop, skipping the frames not in use
+// when page_words is given, writes the same bytes as the reference
+static void compare(uint32_t stop, uint32_t page_words) {
+    FILE *a = tmpfile(), *b = tmpfile();
+    dump_reference(a, mem, stop);
+    if (page_words) {
+        fprintf_mem_pages(b, mem, stop, page_words, frame_in_use);
+    } else {
+        fprintf_mem_nonzero(b, mem, stop);
+    }
+    long len = ftell(a);
+    bool same = len == ftell(b);
+    rewind(a);
+    rewind(b);
+    for (int c = 0; same && c != EOF; ) {
+        c = fgetc(a);
+        same = c == fgetc(b);
+    }
+    fprintf(stdout, "Up to %u%s: %ld bytes, identical: %d\n", stop, page_words ? " by page" : "", len, same);
+    fclose(a);
+    fclose(b);
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/brk_code.obj", "programs/brk_heap.obj");
+    reg[PTBR] = 4096;
+    allocMem(4096, 12, UINT16_MAX, UINT16_MAX);
+    for (uint16_t off = 0; off < PAGE_WORDS; off++) {
+        mw(12 << PAGE_SHIFT | off, off * 7 + 1);  // more lines than one buffer holds
+    }
+    mw(12 << PAGE_SHIFT | 5, UINT16_MAX);
+
+    compare(4160, 0);
+    compare(MEM_WORDS, 0);
+    compare(MEM_WORDS, PAGE_WORDS);
+    freeMem(12, 4096);                        // the freed frame keeps its words, they are still dumped
+    compare(MEM_WORDS, PAGE_WORDS);
+
+    return 0;
+}
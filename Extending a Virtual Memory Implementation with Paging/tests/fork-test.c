@@ -0,0 +1,24 @@
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    mw(0x4000, 42);
+    tfork();                                  // child 1 shares all four frames
+    fprintf(stdout, "Child pid: %d\n", reg[R0]);
+    fprintf(stdout, "Occupied memory after the fork:\n");
+    fprintf_mem_nonzero(stdout, mem, 4160);
+    loadProc(1);
+    fprintf(stdout, "Child R0: %d\n", reg[R0]);
+    mw(0x4000, 7);                            // the child gets its own heap page
+    fprintf(stdout, "%d\n", mr(0x4000));
+    loadProc(0);
+    fprintf(stdout, "%d\n", mr(0x4000));
+    mw(0x4000, 43);                           // the parent is the last user of the frame
+    fprintf(stdout, "%d\n", mr(0x4000));
+    fprintf(stdout, "Occupied memory after both heaps were written:\n");
+    fprintf_mem_nonzero(stdout, mem, 4160);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#define PAGE_SHIFT   (10)
+#define FRAME_COUNT  (128)
+#define MAX_PROCS    (16)
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    fprintf(stdout, "Page words: %d, pages: %d, reserved frames: %d, free frames: %d\n",
+            PAGE_WORDS, VPN_COUNT, OS_RESERVED, (int)free_frames);
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    fprintf(stdout, "Free frames after loading two processes: %d\n", (int)free_frames);
+    loadProc(0);
+    run(NULL, NULL);
+    fprintf(stdout, "R1: %d, free frames after both halted: %d\n", reg[R1], (int)free_frames);
+
+    int mapped = 0, intact = 0;
+    for (int pid = 0; pid < 3; pid++) {
+        reg[PTBR] = PT_ADDR(pid);
+        for (int vpn = CODE_VPN; vpn < VPN_COUNT && allocMem(reg[PTBR], vpn, UINT16_MAX, UINT16_MAX); vpn++) {
+            mw(vpn << PAGE_SHIFT, pid * VPN_COUNT + vpn);  // every page lands in a frame of its own
+            mapped++;
+        }
+    }
+    for (int pid = 0; pid < 3; pid++) {
+        reg[PTBR] = PT_ADDR(pid);
+        for (int vpn = CODE_VPN; vpn < VPN_COUNT; vpn++) {
+            intact += (mem[PTE_ADDR(reg[PTBR], vpn)] & PTE_VALID) && mr(vpn << PAGE_SHIFT) == pid * VPN_COUNT + vpn;
+        }
+    }
+    fprintf(stdout, "Pages mapped: %d, intact: %d, OS status: %d\n", mapped, intact, mem[OS_STATUS]);
+
+    return 0;
+}
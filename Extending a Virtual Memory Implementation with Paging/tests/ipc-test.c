@@ -0,0 +1,86 @@
+#include "../vm.c"
+
+static void shm(uint16_t address, uint16_t key, uint16_t count) {
+    reg[R0] = address;
+    reg[R1] = key;
+    reg[R2] = count;
+    tshm();
+    fprintf(stdout, "R0: %d\n", reg[R0]);
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    uint16_t initial = free_frames;
+    loadProc(0);
+    shm((10 << 11) | 0x7, 5, 2);              // creates region 5 with two frames
+    mw(10 << 11, 42);
+    loadProc(1);
+    shm((12 << 11) | 0x3, 5, 1);              // its first page, read-only
+    fprintf(stdout, "%d\n", mr(12 << 11));
+    shm((13 << 11) | 0x3, 5, 3);              // larger than the region
+    shm((12 << 11) | 0x3, 6, 1);              // page 12 is taken
+    fprintf(stdout, "Frames used by the region: %d\n", initial - free_frames);
+
+    loadProc(0);
+    tfork();                                  // the child keeps writing to the same frame
+    loadProc(2);
+    mw(10 << 11, 7);
+    loadProc(1);
+    fprintf(stdout, "%d\n", mr(12 << 11));
+    fprintf(stdout, "Occupied memory after the fork:\n");
+    fprintf_mem_nonzero(stdout, mem, 4192);
+
+    reg[R0] = 12 << 11;
+    reg[R1] = 8;
+    twait();                                  // the word holds 7, no wait
+    fprintf(stdout, "R0: %d, current pid: %d\n", reg[R0], mem[0]);
+    reg[R0] = 12 << 11;
+    reg[R1] = 7;
+    twait();                                  // 1 waits, 2 runs next
+    fprintf(stdout, "R0: %d, current pid: %d\n", reg[R0], mem[0]);
+    reg[R0] = 10 << 11;
+    reg[R1] = 7;
+    twait();                                  // 2 waits on the same word, 0 runs next
+    fprintf(stdout, "R0: %d, current pid: %d\n", reg[R0], mem[0]);
+    tyld();                                   // 0 is the only runnable process
+    mw(10 << 11, 8);
+    reg[R0] = 10 << 11;
+    tnotify();
+    fprintf(stdout, "Woken: %d\n", reg[R0]);
+    tyld();                                   // 1 and 2 are back in the round
+    tyld();
+
+    shm(0, 5, 0);                             // the frames stay mapped
+    shm(0, 5, 0);
+    fprintf(stdout, "Frames used after the removal: %d\n", initial - free_frames);
+    for (int pid = 0; pid < 3; pid++) {
+        loadProc(pid);
+        thalt();
+    }
+    fprintf(stdout, "Free frames after every process halted: %d of %d\n", free_frames, initial + 8);
+
+    initOS();
+    running = true;
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    reg[R0] = 0x4000;
+    reg[R1] = mr(0x4000);
+    twait();                                  // nobody is left to notify it
+    fprintf(stdout, "Running: %d\n", running);
+
+    memset(mem, 0, sizeof(mem));              // initOS() keeps the page tables
+    initOS();
+    running = true;
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(1);
+    reg[R0] = 0x4000;
+    reg[R1] = mr(0x4000);
+    twait();                                  // 1 waits, 0 runs next
+    thalt();                                  // and halts without a NOTIFY
+    fprintf(stdout, "Running: %d\n", running);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#define VM_JIT
+#include "../vm.c"
+
+uint16_t code[64];
+int n = 0;
+
+static int emit(uint16_t w) {
+    code[n] = w;
+    return n++;
+}
+
+// PC offset from the instruction at index at to index target
+static uint16_t off(int at, int target, int bits) {
+    return (target - (at + 1)) & ((1 << bits) - 1);
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+
+    // A loop over every kind of instruction but ST, which cannot write to the
+    // read-only code page. It runs long enough for its blocks to be compiled.
+    emit(0x5020);                              // AND R0,R0,#0
+    emit(0x5260);                              // AND R1,R1,#0
+    int ld_count = emit(0x2a00);               // LD R5,COUNT
+    int lea_data = emit(0xec00);               // LEA R6,DATA
+    int loop = emit(0x1245);                   // ADD R1,R1,R5
+    emit(0x103d);                              // ADD R0,R0,#-3
+    emit(0x943f);                              // NOT R2,R0
+    emit(0x5681);                              // AND R3,R2,R1
+    emit(0x6980);                              // LDR R4,R6,#0
+    emit(0x1903);                              // ADD R4,R4,R3
+    int ldi = emit(0xa400);                    // LDI R2,HEAP
+    emit(0x1484);                              // ADD R2,R2,R4
+    int sti = emit(0xb400);                    // STI R2,HEAP
+    int ld_heap = emit(0x2600);                // LD R3,HEAP
+    emit(0x72c1);                              // STR R1,R3,#1
+    int jsr = emit(0x4800);                    // JSR SUB
+    int brz = emit(0x0400);                    // BRz SKIP
+    emit(0x1261);                              // ADD R1,R1,#1
+    int skip = emit(0xe600);                   // LEA R3,SUB
+    emit(0x40c0);                              // JSRR R3
+    emit(0x1b7f);                              // ADD R5,R5,#-1
+    int brp = emit(0x0200);                    // BRp LOOP
+    emit(0x1060);                              // ADD R0,R1,#0
+    emit(0xf027);                              // TRAP OUTU16
+    emit(0xf025);                              // HALT
+    int sub = emit(0x14a1);                    // SUB: ADD R2,R2,#1
+    emit(0x54a7);                              // AND R2,R2,#7
+    emit(0xc1c0);                              // RET
+    int count = emit(300);                     // COUNT
+    int data = emit(0x1234);                   // DATA
+    int heap = emit(0x4000);                   // HEAP
+
+    code[ld_count] |= off(ld_count, count, 9);
+    code[lea_data] |= off(lea_data, data, 9);
+    code[ldi] |= off(ldi, heap, 9);
+    code[sti] |= off(sti, heap, 9);
+    code[ld_heap] |= off(ld_heap, heap, 9);
+    code[jsr] |= off(jsr, sub, 11);
+    code[brz] |= off(brz, skip, 9);
+    code[skip] |= off(skip, sub, 9);
+    code[brp] |= off(brp, loop, 9);
+
+    uint16_t pfn = PTE_PFN(mem[PT_ADDR(0) + CODE_VPN]);
+    uint16_t heap_pfn = PTE_PFN(mem[PT_ADDR(0) + HEAP_VPN]);
+    memcpy(mem + FRAME_ADDR(pfn), code, sizeof(code));
+    run(NULL, NULL);
+
+    fprintf(stdout, "Heap: %d %d\n", mem[FRAME_ADDR(heap_pfn)], mem[FRAME_ADDR(heap_pfn) + 1]);
+    fprintf_reg_all(stdout, reg, RCNT);
+    fprintf(stdout, "Compiled blocks: %d\n", jit_blocks > 0);
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    for (int vpn = 0; vpn < 29; vpn++) {
+        allocMem(4096, vpn, UINT16_MAX, UINT16_MAX);  // every free frame
+    }
+    fprintf(stdout, "Occupied memory after allocating every frame:\n");
+    fprintf_mem_nonzero(stdout, mem, 4128);
+    allocMem(4096, 29, UINT16_MAX, UINT16_MAX);       // no frame left
+    freeMem(4, 4096);
+    allocMem(4096, 29, UINT16_MAX, UINT16_MAX);       // reuses the freed frame
+    fprintf(stdout, "Occupied memory after freeing and reallocating one frame:\n");
+    fprintf_mem_nonzero(stdout, mem, 4128);
+
+    return 0;
+}
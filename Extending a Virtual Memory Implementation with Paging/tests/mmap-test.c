@@ -0,0 +1,20 @@
+#define VM_MMAP
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    char *paths[] = {"programs/simple_code.obj", "programs/simple_heap.obj", "programs/brk_code.obj",
+                     "programs/brk_heap.obj", "programs/simple_code.obj", "programs/simple_heap.obj"};
+    img_preload(paths, 6);
+    fprintf(stdout, "Images mapped: %d\n", image_count);  // each file once
+    initOS();
+    createProc(paths[0], paths[1]);
+    createProc(paths[2], paths[3]);
+    createProc(paths[4], paths[5]);
+    fprintf(stdout, "Images mapped after loading: %d\n", image_count);
+    fprintf(stdout, "Occupied memory after program load:\n");
+    fprintf_mem_nonzero(stdout, mem, MEM_WORDS);  // the same words the stdio loader copies
+    loadProc(1);
+    fprintf(stdout, "First word of the brk code: 0x%04x, heap: %d\n", mr(0x3000), mr(0x4000));
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#define _POSIX_C_SOURCE 200809L
+#define VM_PROFILE
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    createProc("programs/brk_code.obj", "programs/brk_heap.obj");
+    loadProc(0);
+    setenv("VM_PROFILE_CSV", "tests/profile-test.csv", 1);
+    run(NULL, NULL);                          // the report goes to stderr, every counter to the CSV file
+
+    FILE *csv = fopen("tests/profile-test.csv", "r");
+    char line[64];
+    while (csv && fgets(line, sizeof(line), csv)) {
+        fputs(line, stdout);
+    }
+    if (csv) {
+        fclose(csv);
+    }
+    remove("tests/profile-test.csv");
+
+    return 0;
+}
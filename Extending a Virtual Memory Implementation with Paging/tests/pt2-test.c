@@ -0,0 +1,32 @@
+#define VM_PT2
+#define MAX_PROCS 256
+#include "../vm.c"
+
+static void print_ptes(uint16_t pid) {
+    uint16_t ptbr = PT_ADDR(pid);
+    for (int vpn = 0; vpn < VPN_COUNT; vpn++) {
+        uint16_t a = PTE_ADDR(ptbr, vpn);
+        if (mem[a]) {
+            fprintf(stdout, "pid %d vpn %d: PTE at %d, page %d\n", pid, vpn, a, pte_page(a));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    fprintf(stdout, "Frames of the OS region for %d processes: %d\n", MAX_PROCS, OS_RESERVED);
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    print_ptes(0);
+    print_ptes(1);
+    fprintf(stdout, "Free frames: %d\n", free_frames);
+    loadProc(1);
+    thalt();                                  // its tables go on the free list
+    fprintf(stdout, "Directory of pid 1 after it halted: %d %d %d %d\n",
+            mem[PT_ADDR(1)], mem[PT_ADDR(1) + 1], mem[PT_ADDR(1) + 2], mem[PT_ADDR(1) + 3]);
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    print_ptes(2);                            // reuses the tables of pid 1
+    fprintf(stdout, "Free frames: %d\n", free_frames);
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#define VM_SWAP
+#define VM_RSS
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    fprintf(stdout, "RSS after creation: %d\n", procRSS(0));  // every page is lazy
+    mr(0x3000);
+    mw(0x4000, 42);
+    for (int vpn = 10; vpn < 14; vpn++) {
+        allocMem(4096, vpn, UINT16_MAX, UINT16_MAX);
+    }
+    fprintf(stdout, "RSS after two faults and four pages: %d\n", procRSS(0));
+    tfork();                                  // the child maps the same six frames
+    fprintf(stdout, "RSS of the child: %d\n", procRSS(1));
+
+    for (int vpn = 14; vpn < 32; vpn++) {
+        allocMem(4128, vpn, UINT16_MAX, UINT16_MAX);
+    }
+    for (int vpn = 10; vpn < 18; vpn++) {
+        allocMem(4160, vpn, UINT16_MAX, UINT16_MAX);  // takes the rest, then evicts
+    }
+    fprintf(stdout, "RSS after evictions: %d, %d, %d\n", procRSS(0), procRSS(1), procRSS(2));
+
+    thalt();                                  // 0 halts, its frames stay with 1
+    fprintf(stdout, "RSS after halting 0: %d, %d, free frames: %d\n", procRSS(0), procRSS(1), free_frames);
+    thalt();
+    fprintf(stdout, "RSS after halting 1: %d, free frames: %d, peaks: %d, %d\n",
+            procRSS(1), free_frames, proc_rss_peak[0], proc_rss_peak[1]);
+    fprintf_mem_nonzero(stdout, mem, OS_FREE_BITMAP + OS_BITMAP_WORDS);
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#define VM_RUNQ
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    for (int p = 0; p < 3; p++) {
+        createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    }
+    loadProc(0);
+    thalt();                                  // process 1 runs next
+    fprintf(stdout, "Current pid after halting 0: %d\n", mem[0]);
+    mw(0x4000, 42);
+    tfork();                                  // the child takes over the PCB of 0
+    fprintf(stdout, "Child pid: %d, PCB count: %d\n", reg[R0], mem[1]);
+    for (int i = 0; i < 4; i++) {
+        tyld();                               // the child 0 runs after 2, at the end of the ring
+    }
+    loadProc(0);
+    fprintf(stdout, "%d\n", mr(0x4000));
+    loadProc(2);
+    thalt();
+    loadProc(1);
+    thalt();                                  // 2 and then 1 are free, 1 is reused first
+    fprintf(stdout, "Current pid after halting 2 and 1: %d\n", mem[0]);
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    fprintf(stdout, "PCB count: %d\n", mem[1]);
+    fprintf(stdout, "Occupied memory after the slots were reused:\n");
+    fprintf_mem_nonzero(stdout, mem, 4224);
+    for (int i = 0; i < 4; i++) {
+        tyld();                               // 0, then 1, 2 and 3 in creation order
+    }
+
+    return 0;
+}
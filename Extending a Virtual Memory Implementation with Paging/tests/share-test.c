@@ -0,0 +1,53 @@
+#define VM_SHARE
+#include "../vm.c"
+
+// Copies programs/simple_code.obj to path, with extra words appended
+static void copy_code(const char *path, int extra) {
+    uint16_t buf[HEAP_START - CODE_START];
+    FILE *in = fopen("programs/simple_code.obj", "rb");
+    size_t n = fread(buf, sizeof(uint16_t), sizeof(buf) / sizeof(buf[0]) - extra, in);
+    fclose(in);
+    for (int k = 0; k < extra; k++) {
+        buf[n++] = 0xf025;                     // HALT
+    }
+    FILE *out = fopen(path, "wb");
+    fwrite(buf, sizeof(uint16_t), n, out);
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    initOS();
+    for (int i = 0; i < 3; i++) {
+        createProc("programs/yld_code.obj", "programs/yld_heap.obj");  // one copy of the code
+    }
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    fprintf(stdout, "Shared code pages: %d\n", (int)code_shared);
+    fprintf(stdout, "Occupied memory after creating four processes:\n");
+    fprintf_mem_nonzero(stdout, mem, 4224);
+    for (int vpn = 0; vpn < 32; vpn++) {
+        freeMem(vpn, 4096);                    // the code frames stay for the other two
+        freeMem(vpn, 4128);
+    }
+    loadProc(2);
+    fprintf(stdout, "%d\n", mr(0x3000));
+    for (int vpn = 0; vpn < 32; vpn++) {
+        freeMem(vpn, 4160);                    // the last user releases them
+    }
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");      // loaded again
+    fprintf(stdout, "Occupied memory after the yld processes went away:\n");
+    fprintf_mem_nonzero(stdout, mem, 4256);
+
+    initOS();
+    copy_code("tests/share-test.obj", 0);
+    createProc("tests/share-test.obj", "programs/simple_heap.obj");
+    uint64_t shared = code_shared;
+    createProc("tests/share-test.obj", "programs/simple_heap.obj");   // same file, shared
+    fprintf(stdout, "Pages shared with an unchanged object: %d\n", (int)(code_shared - shared));
+    copy_code("tests/share-test.obj", 1);
+    shared = code_shared;
+    createProc("tests/share-test.obj", "programs/simple_heap.obj");   // rewritten, loaded again
+    fprintf(stdout, "Pages shared with a rewritten object: %d\n", (int)(code_shared - shared));
+    remove("tests/share-test.obj");
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include "../vm.c"
+
+uint16_t saved[MEM_WORDS];
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(1);
+    mw(0x4000, 42);                              // state that only exists in memory
+    fprintf(stdout, "Snapshot written: %d\n", vm_snapshot("tests/snapshot-test.snap"));
+    memcpy(saved, mem, sizeof(mem));
+
+    initOS();                                    // wipe the machine
+    fprintf(stdout, "Snapshot restored: %d\n", vm_restore("tests/snapshot-test.snap"));
+    fprintf(stdout, "Memory matches: %d\n", memcmp(saved, mem, sizeof(mem)) == 0);
+    fprintf(stdout, "%d %d\n", mem[0], mr(0x4000));
+    fprintf_reg_all(stdout, reg, RCNT);
+
+    FILE *f = fopen("tests/snapshot-test.snap", "r+b");
+    fputc(0, f);                                 // break the magic number
+    fclose(f);
+    fprintf(stdout, "Damaged snapshot restored: %d\n", vm_restore("tests/snapshot-test.snap"));
+    fprintf(stdout, "Processes after the failed restore: %d\n", mem[1]);
+    remove("tests/snapshot-test.snap");
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+#define VM_PARALLEL
+#define VM_DCACHE
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    setenv("VM_WORKERS", "2", 1);
+    initOS();
+    uint16_t spin[2] = {0x5020, 0x0fff};          // AND R0,R0,#0; BRnzp #-1, never yields
+    uint16_t fault[3] = {0xa001, 0xf025, 0x9000}; // LDI R0,#1 through an unmapped address
+    uint16_t *code[2] = {spin, fault};
+    size_t size[2] = {sizeof(spin), sizeof(fault)};
+    for (uint16_t pid = 0; pid < 2; pid++) {
+        createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+        uint16_t pfn = PTE_PFN(mem[PTE_ADDR(PT_ADDR(pid), CODE_VPN)]);
+        memcpy(mem + FRAME_ADDR(pfn), code[pid], size[pid]);
+    }
+    loadProc(0);
+    run(NULL, NULL);                              // the fault of process 1 stops process 0
+    fprintf(stdout, "Stopped by process %d\n", mem[0]);
+
+    return 0;
+}
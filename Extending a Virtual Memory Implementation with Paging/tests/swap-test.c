@@ -0,0 +1,31 @@
+#define VM_SWAP
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    reg[PTBR] = 4096;
+    for (int vpn = 6; vpn < 32; vpn++) {
+        allocMem(4096, vpn, UINT16_MAX, UINT16_MAX);
+        mw(vpn << 11, vpn);                            // tag every page with its vpn
+    }
+    reg[PTBR] = 4128;
+    for (int vpn = 6; vpn < 9; vpn++) {
+        allocMem(4128, vpn, UINT16_MAX, UINT16_MAX);  // every free frame is taken now
+        mw(vpn << 11, vpn + 100);
+    }
+    allocMem(4128, 9, UINT16_MAX, UINT16_MAX);        // evicts the oldest page of the first table
+    reg[PTBR] = 4096;
+    fprintf(stdout, "Evicted PTE: %d\n", mem[4096 + 6]);
+    for (int vpn = 6; vpn < 32; vpn++) {
+        if (mr(vpn << 11) != vpn) {                   // brought back from the swap file
+            fprintf(stdout, "Page %d lost its contents.\n", vpn);
+        }
+    }
+    fprintf(stdout, "Swap-ins: %d, evictions: %d, write-backs: %d\n",
+            (int)swap_ins, (int)evictions, (int)write_backs);
+    freeMem(6, 4128);
+    allocMem(4128, 10, UINT16_MAX, UINT16_MAX);       // takes the freed frame
+    fprintf(stdout, "Evictions after freeing a frame: %d\n", (int)evictions);
+
+    return 0;
+}
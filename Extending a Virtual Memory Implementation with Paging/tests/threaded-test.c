@@ -0,0 +1,14 @@
+#define VM_THREADED
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    loadProc(0);
+    run(NULL, NULL);                          // every YIELD switches the page table under the TLB
+    fprintf(stdout, "R1: %d, R2: %d\n", reg[R1], reg[R2]);
+    fprintf(stdout, "TLB hits: %d, misses: %d\n", (int)tlb_hits, (int)tlb_misses);
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include "../vm.c"
+
+int main(int argc, char **argv) {
+    initOS();
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    loadProc(0);
+    mw(0x4000, 10);
+    mr(0x4000);                               // the heap page of process 0 is cached now
+    tyld();                                   // the switch drops it
+    mw(0x4000, 20);
+    fprintf(stdout, "Process 1 reads %d\n", mr(0x4000));
+    tyld();
+    fprintf(stdout, "Process 0 reads %d\n", mr(0x4000));
+    thalt();                                  // so does a halt
+    fprintf(stdout, "Process 1 reads %d\n", mr(0x4000));
+    fprintf(stdout, "TLB hits: %d, misses: %d\n", (int)tlb_hits, (int)tlb_misses);
+    freeMem(8, 4128);                         // and freeing the page
+    mr(0x4000);
+
+    return 0;
+}
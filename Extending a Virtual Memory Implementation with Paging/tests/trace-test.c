@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L  // setenv
+#define VM_TRACE
+#include "../vm.c"
+
+// Process 0 reads a number, prints it, yields and halts; process 1 runs yld
+static void boot(int procs) {
+    memset(mem, 0, sizeof(mem));               // processes left running keep their page tables
+    initOS();
+    running = true;
+    createProc("programs/simple_code.obj", "programs/simple_heap.obj");
+    for (int p = 1; p < procs; p++) {
+        createProc("programs/yld_code.obj", "programs/yld_heap.obj");
+    }
+    uint16_t code[4] = {0xf026, 0xf027, 0xf028, 0xf025};  // IN_U16, OUT_U16, YIELD, HALT
+    uint16_t pte = mem[PTE_ADDR(PT_ADDR(0), CODE_VPN)];
+    memcpy(mem + FRAME_ADDR(PTE_PFN(pte)), code, sizeof(code));
+    loadProc(0);
+}
+
+int main(int argc, char **argv) {
+    FILE *in = fopen("tests/trace-test.in", "w");
+    fprintf(in, "1234\n");
+    fclose(in);
+    freopen("tests/trace-test.in", "r", stdin);
+
+    setenv("VM_TRACE", "tests/trace-test.trc", 1);
+    boot(2);
+    run(NULL, NULL);
+    fprintf(stdout, "Recorded, R0: %d\n", reg[R0]);
+
+    unsetenv("VM_TRACE");
+    setenv("VM_REPLAY", "tests/trace-test.trc", 1);
+    boot(2);
+    run(NULL, NULL);                           // reads nothing, prints no number
+    fprintf(stdout, "Replayed %u of %u records, diverged: %d, R0: %d\n", trace_pos, trace_len, trace_diverged, reg[R0]);
+
+    boot(3);
+    run(NULL, NULL);                           // another process changes the schedule
+    fprintf(stdout, "Replayed %u of %u records, diverged: %d\n", trace_pos, trace_len, trace_diverged);
+    remove("tests/trace-test.in");
+    remove("tests/trace-test.trc");
+
+    return 0;
+}
@@ -1,3 +1,6 @@
+#if defined(VM_JIT) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS for the JIT arenas
+#endif
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -5,6 +8,70 @@
 #include <string.h>
 #include "vm_dbg.h"
 
+#ifdef VM_PARALLEL
+#include <pthread.h>
+#include <unistd.h>
+#define VM_TLS _Thread_local  // Per guest-worker state in the parallel mode
+#elif defined(VM_HARNESS)
+#define VM_TLS _Thread_local
+#else
+#define VM_TLS
+#endif
+
+#ifdef VM_HARNESS
+#ifdef VM_PARALLEL
+#error "VM_HARNESS runs one machine per host thread, it cannot be combined with VM_PARALLEL"
+#endif
+// The harness runs a whole machine on each of its threads: every piece of VM
+// state is thread-local (a fresh thread starts from a zeroed machine) and the
+// output goes to the stream the thread sets vm_out to.
+#define VM_CTX _Thread_local
+_Thread_local FILE *vm_out;
+#else
+#define VM_CTX
+#define vm_out stdout
+#endif
+
+#ifdef VM_MMAP
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef VM_SHARE
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#ifdef VM_CONIO
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef VM_JIT
+#if !defined(__x86_64__)
+#error "VM_JIT emits x86-64 code"
+#endif
+#if defined(VM_PARALLEL) || defined(VM_PROFILE)
+#error "VM_JIT runs compiled blocks on the single-threaded run() loop and does not sample them"
+#endif
+#include <sys/mman.h>
+#ifndef VM_DCACHE
+#define VM_DCACHE  // Blocks are compiled from the decoded pages, the interpreter runs the cold ones
+#endif
+#endif
+
+#ifdef VM_SWAP
+#ifdef VM_PARALLEL
+#error "VM_SWAP evicts frames behind the back of the other workers' TLBs, it cannot be combined with VM_PARALLEL"
+#endif
+#ifndef VM_DEMAND
+#define VM_DEMAND  // Evicted pages come back through the demand paging fault
+#endif
+#endif
+
 #define NOPS (16)
 
 #define OPC(i) ((i) >> 12)
@@ -24,24 +91,140 @@
 
 /* New OS declarations */
 
+// Geometry of the simulated machine. Each of these can be overridden at build
+// time, e.g. make sample CFLAGS="-std=c11 -Wall -DFRAME_COUNT=128 -DMAX_PROCS=256",
+// everything below is derived from them and checked by the static asserts.
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT      (11)    // log2 of the page size in words
+#endif
+#ifndef FRAME_COUNT
+#define FRAME_COUNT     (32)    // Number of physical page frames
+#endif
+#ifndef MAX_PROCS
+#define MAX_PROCS       (64)    // Number of PCBs and page tables the OS region holds
+#endif
+
+#define PAGE_WORDS      (1 << PAGE_SHIFT)               // Page size in 16-bit words
+#define PAGE_SIZE       (PAGE_WORDS * 2)                // Page size in bytes
+#define OFFSET_MASK     (PAGE_WORDS - 1)                // Offset bits of a virtual address
+#define VPN_COUNT       (1 << (16 - PAGE_SHIFT))        // Pages of the address space, entries of a page table
+#define MEM_WORDS       ((uint32_t)FRAME_COUNT << PAGE_SHIFT)
+#define FRAME_ADDR(pfn) ((uint32_t)(pfn) << PAGE_SHIFT)
+
 // OS bookkeeping constants
-#define PAGE_SIZE       (4096)  // Page size in bytes
 #define OS_MEM_SIZE     (2)     // OS Region size. Also the start of the page tables' page
 #define Cur_Proc_ID     (0)     // id of the current process
 #define Proc_Count      (1)     // total number of processes, including ones that finished executing.
 #define OS_STATUS       (2)     // Bit 0 shows whether the PCB list is full or not
 #define OS_FREE_BITMAP  (3)     // Bitmap for free pages
+#define OS_BITMAP_WORDS ((FRAME_COUNT + 15) / 16)  // Words of the free bitmap, frame 0 is the MSB of the first word
+#define PCB_BASE        (OS_FREE_BITMAP + OS_BITMAP_WORDS > 12 ? OS_FREE_BITMAP + OS_BITMAP_WORDS : 12)
+#define PT_BASE         (OS_MEM_SIZE * PAGE_WORDS)     // Start of the page tables
+#define OS_RESERVED     (OS_MEM_SIZE + (PT_AREA + PAGE_WORDS - 1) / PAGE_WORDS)  // Frames of the OS region and page tables
 
 // Process list and PCB related constants
 #define PCB_SIZE  (3)  // Number of fields in a PCB
 #define PID_PCB   (0)  // Holds the pid for a process
 #define PC_PCB    (1)  // Value of the program counter for the process
 #define PTBR_PCB  (2)  // Page table base register for the process
+#define PCB_ADDR(pid)  (PCB_BASE + (pid) * PCB_SIZE)
+#define PT_ADDR(pid)   (PT_BASE + (pid) * PT_WORDS)
+#define PT_PID(ptbr)   (((ptbr) - PT_BASE) / PT_WORDS)
+
+// Page tables. Each process has a flat table of VPN_COUNT PTEs in the OS
+// region by default. With VM_PT2 the OS region only holds a directory of
+// PT_DIR_SIZE words per process, each the address of a second-level table of
+// PT2_ENTRIES PTEs or 0. Those tables are carved out of frames taken from the
+// bitmap the first time a page of their range is mapped, see pte_alloc().
+#ifdef VM_PT2
+#ifndef PT2_ENTRIES
+#define PT2_ENTRIES     (8)     // PTEs of a second-level table
+#endif
+#define PT_DIR_SIZE     (VPN_COUNT / PT2_ENTRIES)
+#define PT_WORDS        (PT_DIR_SIZE)                // Words of the OS region per process
+#define PT2_CHUNK       (PT2_ENTRIES + 1)            // A table and the header word in front of it
+#define PT_ZERO         (PT_ADDR(MAX_PROCS))         // Always 0, stands in for the PTEs of missing tables
+#define PT_FREE         (PT_ADDR(MAX_PROCS) + 1)     // Header of the first free table, the list goes through the headers
+#define PT_AREA         (MAX_PROCS * PT_WORDS + 2)
+#define PTE_ADDR(ptbr, vpn)  pte_addr(ptbr, vpn)
+#define PTE_NEW(ptbr, vpn)   pte_alloc(ptbr, vpn)
+#define PTE_PAGE(a)          pte_page(a)
+#else
+#define PT_WORDS        (VPN_COUNT)
+#define PT_AREA         (MAX_PROCS * PT_WORDS)
+#define PTE_ADDR(ptbr, vpn)  ((ptbr) + (vpn))   // Address of the PTE of vpn in the table at ptbr
+#define PTE_NEW(ptbr, vpn)   ((ptbr) + (vpn))   // The same, creating the table if needed. 0 when that fails
+#define PTE_PAGE(a)          ((a) - PT_BASE)    // Page number pid * VPN_COUNT + vpn of the PTE at a
+#endif
+#define PAGE_ID(ptbr, vpn)   (PT_PID(ptbr) * VPN_COUNT + (vpn))
+#define PAGE_PTE(page)       PTE_ADDR(PT_ADDR((page) / VPN_COUNT), (page) % VPN_COUNT)
+
+// Page table entries keep the frame number in the top bits and flags in the low ones
+#define PTE_VALID       (0x0001)
+#define PTE_READ        (0x0002)
+#define PTE_WRITE       (0x0004)
+#define PTE_LAZY        (0x0008)  // Reserved but not present, see VM_DEMAND
+#define PTE_COW         (0x0010)  // Writable once the shared frame is copied, see tfork()
+#define PTE_REF         (0x0020)  // Accessed since the last replacement scan, see VM_SWAP
+#define PTE_DIRTY       (0x0040)  // Written since it was brought in
+#define PTE_SWAPPED     (0x0080)  // The swap file holds a copy of the page
+#define PTE_TAKEN       (PTE_VALID | PTE_LAZY | PTE_SWAPPED)  // The page exists, resident or not
+#ifdef VM_SWAP
+#define PTE_FLAG_BITS   (8)
+#else
+#define PTE_FLAG_BITS   (5)
+#endif
+#define BITS_FOR(n)     ((n) <= 2 ? 1 : (n) <= 4 ? 2 : (n) <= 8 ? 3 : (n) <= 16 ? 4 : (n) <= 32 ? 5 : \
+                         (n) <= 64 ? 6 : (n) <= 128 ? 7 : (n) <= 256 ? 8 : (n) <= 512 ? 9 : \
+                         (n) <= 1024 ? 10 : (n) <= 2048 ? 11 : (n) <= 4096 ? 12 : 13)
+#define PTE_PFN_SHIFT   (16 - BITS_FOR(FRAME_COUNT))
+#define PTE_PFN(pte)    ((pte) >> PTE_PFN_SHIFT)
+
+// Virtual address space layout, the guest images assume code at 0x3000 and heap at 0x4000
+#define CODE_START      (0x3000)
+#define HEAP_START      (0x4000)
+#define CODE_VPN        (CODE_START >> PAGE_SHIFT)  // First code page, every page below it is reserved
+#define HEAP_VPN        (HEAP_START >> PAGE_SHIFT)
+#define CODE_SIZE       ((HEAP_START - CODE_START) >> PAGE_SHIFT)  // Number of pages for the code segment
+#define HEAP_INIT_SIZE  (0x1000 >> PAGE_SHIFT)                    // Number of pages for the heap segment initially
+
+_Static_assert(CODE_START % PAGE_WORDS == 0 && HEAP_START % PAGE_WORDS == 0, "PAGE_SHIFT must keep 0x3000 and 0x4000 page aligned");
+_Static_assert(PAGE_SHIFT >= 3, "the BRK request bits must fit in a page offset");
+_Static_assert(FRAME_COUNT <= 8192 && BITS_FOR(FRAME_COUNT) <= 16 - PTE_FLAG_BITS, "frame numbers do not fit in a PTE");
+_Static_assert(FRAME_COUNT > OS_RESERVED, "no frames left after the OS region");
+_Static_assert(PCB_ADDR(MAX_PROCS) <= PT_BASE, "the PCB list overlaps the page tables");
+_Static_assert(PT_BASE + PT_AREA <= 0x10000, "page tables must be reachable through the 16-bit PTBR");
+_Static_assert(MAX_PROCS * VPN_COUNT <= 0x10000, "page numbers must fit in 16 bits");
+#ifdef VM_PT2
+_Static_assert(VPN_COUNT % PT2_ENTRIES == 0 && PT2_CHUNK <= PAGE_WORDS, "PT2_ENTRIES must divide the address space");
+#endif
+
+// Preemptive scheduler constants
+#define MLFQ_LEVELS  (3)   // Priority levels of the multi-level feedback policy
+#define MLFQ_BOOST   (64)  // Base quanta between two boosts of every process to the top level
+
+// Software TLB constants
+#define TLB_SIZE  (8)  // Number of entries, direct mapped on the low VPN bits (power of two)
+
+VM_TLS bool running = true;
 
-#define CODE_SIZE       (2)  // Number of pages for the code segment
-#define HEAP_INIT_SIZE  (2)  // Number of pages for the heap segment initially
+VM_CTX uint16_t free_frames = 0;  // Number of set bits in OS_FREE_BITMAP
+VM_CTX int bitmap_hint = 0;       // Every bitmap word before this one is empty
+VM_CTX uint16_t frame_ref[FRAME_COUNT];  // Page table entries mapping each frame besides the first
+VM_CTX uint16_t frame_seen[OS_BITMAP_WORDS];  // Frames ever handed out, laid out like OS_FREE_BITMAP
 
-bool running = true;
+// Shared memory regions, see tshm(). A region holds the first reference to
+// each of its frames, every PTE mapping one counts in frame_ref.
+#define SHM_REGIONS  (16)
+typedef struct {
+    bool used;
+    uint16_t key;
+    uint16_t pages;
+    uint16_t pfn[VPN_COUNT];
+} shm_region;
+VM_CTX shm_region shm_regions[SHM_REGIONS];
+VM_CTX bool frame_shm[FRAME_COUNT];   // Frames of shared regions, fork keeps them shared
+VM_CTX uint32_t wait_key[MAX_PROCS];  // Physical word each process waits on, 0 when it is runnable
 
 typedef void (*op_ex_f)(uint16_t i);
 typedef void (*trp_ex_f)();
@@ -50,21 +233,389 @@ enum { trp_offset = 0x20 };
 enum regist { R0 = 0, R1, R2, R3, R4, R5, R6, R7, RPC, RCND, PTBR, RCNT };
 enum flags { FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
 
-uint16_t mem[UINT16_MAX] = {0};
-uint16_t reg[RCNT] = {0};
-uint16_t PC_START = 0x3000;
+VM_CTX uint16_t mem[MEM_WORDS] = {0};
+VM_TLS uint16_t reg[RCNT] = {0};
+uint16_t PC_START = CODE_START;
+
+// A TLB entry caches a valid PTE of the page table it was read from
+typedef struct {
+    uint16_t ptbr;  // Tag: page table base of the owner, 0 when the entry is empty
+    uint16_t vpn;   // Tag: virtual page number
+    uint16_t pte;   // Cached page table entry
+} tlb_entry;
+
+VM_TLS tlb_entry tlb[TLB_SIZE] = {{0}};
+VM_TLS uint64_t tlb_hits = 0;
+VM_TLS uint64_t tlb_misses = 0;
+
+#if defined(VM_STATS) || defined(VM_BENCH)
+VM_TLS uint64_t insn_count = 0;    // Instructions executed
+VM_TLS uint64_t switch_count = 0;  // Switches from one process to another
+#define COUNT_INSN()    (insn_count++)
+#define COUNT_SWITCH()  (switch_count++)
+#else
+#define COUNT_INSN()
+#define COUNT_SWITCH()
+#endif
+
+#ifdef VM_PARALLEL
+// In the parallel mode mem[Cur_Proc_ID] is meaningless since several guests run
+// at once, every worker keeps the pid of the guest it is running instead.
+VM_TLS uint16_t cur_pid = 0xffff;
+VM_TLS bool yielded = false;  // Set by tyld() to hand the worker back to the scheduler
+
+pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards OS_FREE_BITMAP and OS_STATUS
+pthread_mutex_t pcb_lock = PTHREAD_MUTEX_INITIALIZER;    // Guards Proc_Count and PCB creation
+#define OS_LOCK(l)    pthread_mutex_lock(&(l))
+#define OS_UNLOCK(l)  pthread_mutex_unlock(&(l))
+#define CUR_PID       (cur_pid)
+#else
+#define OS_LOCK(l)
+#define OS_UNLOCK(l)
+#define CUR_PID       (mem[Cur_Proc_ID])
+#endif
+
+#if defined(VM_PREEMPT) && defined(VM_PARALLEL)
+#error "VM_PREEMPT schedules the single-threaded run() loop, it cannot be combined with VM_PARALLEL"
+#endif
+
+#if defined(VM_PARALLEL) || defined(VM_PREEMPT)
+VM_CTX uint16_t guest_reg[MAX_PROCS][RCNT];  // Saved register context of each process
+#define FORK_IN(pid)
+#else
+// Processes share one register file, the only register kept per process is
+// the R0 = 0 a forked child starts with. FORK_IN() applies it on its first load.
+VM_CTX bool fork_child[MAX_PROCS];
+#define FORK_IN(pid) do { if (fork_child[pid]) { fork_child[pid] = false; reg[R0] = 0; } } while (0)
+#endif
+
+#ifdef VM_PREEMPT
+VM_CTX uint32_t quantum = 100;     // Instructions per time slice, VM_QUANTUM overrides it
+VM_CTX bool sched_mlfq = false;    // VM_SCHED=mlfq selects the multi-level feedback policy
+VM_CTX uint64_t ticks = 0;         // Instructions executed since run() started
+VM_CTX uint64_t slice_end = 0;     // Tick at which the current process is preempted
+VM_CTX uint64_t next_boost = 0;    // Tick of the next MLFQ priority boost
+VM_CTX uint8_t proc_level[MAX_PROCS];
+VM_CTX uint64_t proc_run[MAX_PROCS];    // Instructions executed by each process
+VM_CTX uint64_t proc_wait[MAX_PROCS];   // Ticks each process spent runnable but not running
+VM_CTX uint64_t proc_since[MAX_PROCS];  // Tick of the last switch in or out of each process
+VM_CTX bool sched_resume = false;       // Set by vm_restore() for a snapshot taken mid-run
+static void tpreempt();
+// Counted when an instruction is fetched, checked between two instructions
+#define PREEMPT_TICK()  (ticks++)
+#define PREEMPT_CHECK() do { if (ticks >= slice_end && running) tpreempt(); } while (0)
+#else
+#define PREEMPT_TICK()
+#define PREEMPT_CHECK()
+#endif
+
+#ifdef VM_RUNQ
+#ifdef VM_PARALLEL
+#error "VM_PARALLEL schedules from a ready queue of its own"
+#endif
+// Run queue. The live processes form a ring in scheduling order, so the next
+// one is a link away however many have terminated, and new ones join in front
+// of rq_head, the end of the round. A terminated PCB goes on a free list and
+// the next process created takes it over, with its page table.
+VM_CTX uint16_t rq_next[MAX_PROCS];
+VM_CTX uint16_t rq_prev[MAX_PROCS];
+VM_CTX uint16_t rq_head = 0xffff;   // 0xffff when no process is live
+VM_CTX uint16_t pcb_free = 0xffff;  // First free PCB, 0xffff when there is none
+VM_CTX uint16_t pcb_link[MAX_PROCS];  // The free PCB after each free one
+
+static void rq_insert(uint16_t pid) {
+    if (rq_head == 0xffff) {
+        rq_head = rq_next[pid] = rq_prev[pid] = pid;
+        return;
+    }
+    rq_next[pid] = rq_head;
+    rq_prev[pid] = rq_prev[rq_head];
+    rq_next[rq_prev[rq_head]] = pid;
+    rq_prev[rq_head] = pid;
+}
+
+// Unlinks pid. Its rq_next still leads to the process after it.
+static void rq_remove(uint16_t pid) {
+    if (rq_next[pid] == pid) {
+        rq_head = 0xffff;
+        return;
+    }
+    rq_next[rq_prev[pid]] = rq_next[pid];
+    rq_prev[rq_next[pid]] = rq_prev[pid];
+    if (rq_head == pid) {
+        rq_head = rq_next[pid];
+    }
+}
+
+// PCB for a new process: a free one, or the next unused one when there is none.
+// A free PCB keeps the cleared PTEs of its last process until it is taken.
+static uint16_t pcb_take() {
+    if (pcb_free == 0xffff) {
+        return mem[Proc_Count];
+    }
+    memset(mem + PT_ADDR(pcb_free), 0, PT_WORDS * sizeof(uint16_t));
+    return pcb_free;
+}
+
+// Takes the PCB pcb_take() returned once the process is set up in it. The
+// process is live from then on.
+static void pcb_commit(uint16_t pid) {
+    if (pid == pcb_free) {
+        pcb_free = pcb_link[pid];
+    } else {
+        mem[Proc_Count]++;
+    }
+    rq_insert(pid);
+}
+#endif
+
+#ifdef VM_TRACE
+#ifdef VM_PARALLEL
+#error "VM_TRACE needs a single scheduler to order the events"
+#endif
+#ifdef VM_CONIO
+#error "VM_TRACE records the input of the stdio console traps"
+#endif
+// Execution traces, see trace_init(). One of the two is set while a trace is
+// recorded or replayed.
+VM_CTX FILE *trace_file = NULL;     // Trace being recorded
+VM_CTX uint16_t *trace_buf = NULL;  // Trace being replayed, two words per record
+VM_CTX uint32_t trace_len = 0;      // Records in trace_buf
+VM_CTX uint32_t trace_pos = 0;      // Next record to replay
+VM_CTX bool trace_diverged = false;
+static void trace_init();
+static void trace_finish();
+static void trace_call(int n);
+static void trace_switch(uint16_t from, uint16_t to);
+#define TRACE_SWITCH(from, to) trace_switch(from, to)
+#else
+#define TRACE_SWITCH(from, to)
+#endif
+
+#ifdef VM_PROFILE
+// Profiler counters. They are indexed by pid, a guest only runs on one worker
+// at a time so the parallel mode needs no locking for them.
+VM_CTX uint32_t prof_period = 1;             // VM_PROFILE_SAMPLE=n records every n-th instruction
+VM_TLS uint32_t prof_countdown = 1;   // Instructions until the next sample
+VM_CTX uint32_t *prof_pc[MAX_PROCS];         // Samples per guest PC, allocated on first use
+VM_CTX uint64_t prof_op[MAX_PROCS][NOPS];    // Samples per opcode, TRAP counts the traps
+VM_CTX uint64_t prof_faults[MAX_PROCS];      // Demand paging and copy-on-write faults
+VM_CTX uint64_t prof_switches[MAX_PROCS];    // Times the process left the CPU for another one
+static void prof_sample(uint8_t op);
+#define PROFILE_INSN(op)  do { if (--prof_countdown == 0) prof_sample(op); } while (0)
+#define PROFILE_COUNT(a, pid)  do { uint16_t p_ = (pid); if (p_ < MAX_PROCS) (a)[p_]++; } while (0)
+#else
+#define PROFILE_INSN(op)
+#define PROFILE_COUNT(a, pid)
+#endif
+
+#ifdef VM_CONIO
+#ifndef CON_BUF
+#define CON_BUF         (1024)  // Bytes of console output buffered per process, and of input read ahead
+#endif
+#define CON_AGAIN       (-2)    // No input is ready yet, unlike EOF
+VM_CTX char con_out[MAX_PROCS][CON_BUF];  // Output of each process not written to stdout yet
+VM_CTX uint16_t con_len[MAX_PROCS];
+VM_CTX char con_in[CON_BUF];              // Input read ahead from stdin, shared by every process
+VM_CTX size_t con_pos = 0;
+VM_CTX size_t con_end = 0;
+VM_CTX bool con_eof = false;
+VM_CTX bool con_blocked[MAX_PROCS];       // Descheduled until input arrives
+#ifdef VM_PARALLEL
+pthread_mutex_t con_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the input buffer and con_blocked
+#define CON_WAITS(pid)  (false)  // Workers only yield, the guest is back in the ready queue
+#else
+#define CON_WAITS(pid)  (con_blocked[pid])  // Left out of the round like a WAIT
+#endif
+static void con_flush(uint16_t pid);
+// Writes out the output of the current process before the OS prints anything
+#define CON_SYNC()  con_flush(CUR_PID)
+#else
+#define CON_WAITS(pid)  (false)
+#define CON_SYNC()
+#endif
+
+#ifdef VM_DEMAND
+VM_CTX char *proc_image[MAX_PROCS][2];          // Code and heap image of each process
+VM_CTX uint16_t proc_image_size[MAX_PROCS][2];  // Image sizes in words
+VM_CTX uint64_t page_faults = 0;
+static uint16_t page_fault(uint16_t vpn);
+#endif
+
+#ifdef VM_SWAP
+VM_CTX bool replace_lru = false;           // VM_REPLACE=lru selects aging instead of the clock
+VM_CTX FILE *swap_file = NULL;             // VM_SWAPFILE names it, an anonymous temporary file otherwise
+VM_CTX uint16_t frame_owner[FRAME_COUNT];  // Address of the PTE mapping each frame, 0 when unmapped
+VM_CTX uint8_t frame_age[FRAME_COUNT];     // Aging counters of the LRU approximation
+VM_CTX int clock_hand = 0;
+VM_CTX uint64_t swap_ins = 0;
+VM_CTX uint64_t evictions = 0;
+VM_CTX uint64_t write_backs = 0;
+static void swap_init();
+static int swap_out(int keep);
+static void swap_io(uint16_t page, uint16_t *buf, bool out);
+static uint16_t frame_rmap(uint16_t pfn);
+#endif
+
+#ifdef VM_SHARE
+typedef struct {
+    char *path;               // NULL for an unused entry
+    dev_t dev;                // File the object was read from, and its version
+    ino_t ino;
+    time_t mtime;
+    off_t bytes;
+    uint16_t size;            // Image size in words
+    uint16_t pfn[CODE_SIZE];  // Frame of each page, 0 while it is not resident
+} code_image;
+
+VM_CTX code_image code_images[MAX_PROCS];  // Code objects in use, see code_read()
+VM_CTX uint64_t code_shared = 0;           // Code pages mapped from another process instead of loaded
+#endif
 
 void initOS();
 int createProc(char *fname, char *hname);
+static int createProcLocked(char *fname, char *hname);
 void loadProc(uint16_t pid);
 uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write);  // Can use 'bool' instead
+static uint16_t map_frame(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write);
 int freeMem(uint16_t ptr, uint16_t ptbr);
+uint16_t allocRange(uint16_t ptbr, uint16_t vpn, uint16_t count, uint16_t read, uint16_t write);
+int freeRange(uint16_t vpn, uint16_t count, uint16_t ptbr);
+static int unmap_frame(uint16_t a);
+int frame_in_use(uint32_t pfn);
+void tlb_flush();
+static inline uint16_t tlb_lookup(uint16_t vpn);
 static inline uint16_t mr(uint16_t address);
 static inline void mw(uint16_t address, uint16_t val);
 static inline void tbrk();
+static inline void tbrkn();
+static inline void tshm();
+static inline void twait();
+static inline void tnotify();
+static inline void tckpt();
 static inline void thalt();
 static inline void tyld();
+static inline void tfork();
 static inline void trap(uint16_t i);
+static int bitmap_alloc();
+static int bitmap_alloc_run(int count);
+static void bitmap_free(uint16_t pfn);
+static void bitmap_free_run(int first, int count);
+
+#ifdef VM_PT2
+// Address of the PTE of vpn in the page table at ptbr. A missing second-level
+// table reads as PT_ZERO, a PTE with no bits set.
+static inline uint16_t pte_addr(uint16_t ptbr, uint16_t vpn) {
+    uint16_t t = mem[ptbr + vpn / PT2_ENTRIES];
+    return t ? t + vpn % PT2_ENTRIES : PT_ZERO;
+}
+
+// pte_addr() that first creates the second-level table if it is missing.
+// Returns 0 when no frame is left for it. Callers hold frame_lock.
+static uint16_t pte_alloc(uint16_t ptbr, uint16_t vpn) {
+    uint16_t *dir = &mem[ptbr + vpn / PT2_ENTRIES];
+    if (*dir == 0) {
+        if (mem[PT_FREE] == 0) {
+            int pfn = bitmap_alloc();
+#ifdef VM_SWAP
+            if (pfn == -1) {
+                pfn = swap_out(-1);  // Its frame_owner stays 0, page tables are never evicted
+            }
+#endif
+            if (pfn == -1) {
+                return 0;
+            }
+            if (FRAME_ADDR(pfn) >= 0x10000) {
+                bitmap_free(pfn);  // Only the first 64K words are reachable through a directory entry
+                return 0;
+            }
+            if (free_frames == 0) {
+                mem[2] = 0x0001;
+            }
+            for (int c = PAGE_WORDS / PT2_CHUNK - 1; c >= 0; c--) {
+                uint16_t t = FRAME_ADDR(pfn) + c * PT2_CHUNK;
+                mem[t] = mem[PT_FREE];
+                mem[PT_FREE] = t;
+            }
+        }
+        uint16_t t = mem[PT_FREE];
+        mem[PT_FREE] = mem[t];
+        mem[t] = PAGE_ID(ptbr, vpn - vpn % PT2_ENTRIES);  // The header holds the page of the first PTE
+        memset(mem + t + 1, 0, PT2_ENTRIES * sizeof(uint16_t));
+        *dir = t + 1;
+    }
+    return *dir + vpn % PT2_ENTRIES;
+}
+
+// Page number of the PTE at a, from the header of its table
+static inline uint16_t pte_page(uint16_t a) {
+    uint16_t frame = a & ~OFFSET_MASK;
+    uint16_t t = frame + (a - frame) / PT2_CHUNK * PT2_CHUNK;
+    return mem[t] + (a - t - 1);
+}
+
+// Puts the second-level tables of the page table at ptbr on the free list.
+// Its pages are unmapped already. Callers hold frame_lock.
+static void pt2_release(uint16_t ptbr) {
+    for (int d = 0; d < PT_DIR_SIZE; d++) {
+        if (mem[ptbr + d]) {
+            uint16_t t = mem[ptbr + d] - 1;
+            mem[t] = mem[PT_FREE];
+            mem[PT_FREE] = t;
+            mem[ptbr + d] = 0;
+        }
+    }
+}
+#endif
+
+#ifdef VM_RSS
+// Resident sets. Every PTE write is followed by RSS_NOTE(), which files the
+// page under proc_resident when it is valid and under proc_reserved when it
+// only holds a lazy or swapped out page. HALT visits the pages in the masks
+// instead of the whole page table, and proc_rss counts the resident ones.
+#define RSS_WORDS  ((VPN_COUNT + 31) / 32)
+VM_CTX uint32_t proc_resident[MAX_PROCS][RSS_WORDS];
+VM_CTX uint32_t proc_reserved[MAX_PROCS][RSS_WORDS];
+VM_CTX uint16_t proc_rss[MAX_PROCS];       // Resident pages of each process
+VM_CTX uint16_t proc_rss_peak[MAX_PROCS];  // Its high-water mark
+
+// Refiles the page of the PTE at a after a write to it. Tables outside the
+// PT area are not tracked.
+static void rss_note(uint16_t a) {
+#ifdef VM_PT2
+    if (a == PT_ZERO) {
+        return;  // Stands in for the PTEs of every missing table
+    }
+#endif
+    uint32_t page = PTE_PAGE(a);
+    if (page >= MAX_PROCS * VPN_COUNT) {
+        return;
+    }
+    uint16_t pid = page / VPN_COUNT;
+    uint16_t vpn = page % VPN_COUNT;
+    uint32_t bit = 1u << (vpn % 32);
+    uint32_t *res = &proc_resident[pid][vpn / 32];
+    uint32_t *rsv = &proc_reserved[pid][vpn / 32];
+    uint16_t pte = mem[a];
+    // Workers of VM_PARALLEL may refile pages of one process at once
+    bool was = __atomic_fetch_and(res, ~bit, __ATOMIC_RELAXED) & bit;
+    __atomic_fetch_and(rsv, ~bit, __ATOMIC_RELAXED);
+    if (pte & PTE_VALID) {
+        __atomic_fetch_or(res, bit, __ATOMIC_RELAXED);
+    } else if (pte & (PTE_LAZY | PTE_SWAPPED)) {
+        __atomic_fetch_or(rsv, bit, __ATOMIC_RELAXED);
+    }
+    if (was != ((pte & PTE_VALID) != 0)) {
+        uint16_t rss = __atomic_add_fetch(&proc_rss[pid], was ? -1 : 1, __ATOMIC_RELAXED);
+        if (rss > proc_rss_peak[pid]) {
+            proc_rss_peak[pid] = rss;
+        }
+    }
+}
+#define RSS_NOTE(a) rss_note(a)
+#else
+#define RSS_NOTE(a)
+#endif
 
 static inline uint16_t sext(uint16_t n, int b) { return ((n >> (b - 1)) & 1) ? (n | (0xFFFF << b)) : n; }
 static inline void uf(enum regist r) {
@@ -90,21 +641,249 @@ static inline void sti(uint16_t i)  { mw(mr(reg[RPC] + POFF9(i)), reg[DR(i)]); }
 static inline void str(uint16_t i)  { mw(reg[SR1(i)] + POFF(i), reg[DR(i)]); }
 static inline void rti(uint16_t i)  {} // unused
 static inline void res(uint16_t i)  {} // unused
+#ifdef VM_CONIO
+// Console I/O. Guest output collects in a per-process buffer that is written
+// with one fwrite when it fills up and whenever the process yields, halts,
+// faults or makes a trap that prints an OS message, so the order of the output
+// does not change. Input is read ahead from stdin without blocking; a process
+// that finds no input ready gives the CPU to another one and stays out of the
+// round until input arrives, then retries the trap. Only when no other process
+// can run does the interpreter block on stdin.
+static void con_flush(uint16_t pid) {
+  if (pid < MAX_PROCS && con_len[pid] > 0) {
+    fwrite(con_out[pid], 1, con_len[pid], vm_out);
+    con_len[pid] = 0;
+  }
+}
+
+static inline void con_putc(char c) {
+  uint16_t pid = CUR_PID;
+  if (pid >= MAX_PROCS) {
+    fputc(c, vm_out);
+    return;
+  }
+  con_out[pid][con_len[pid]++] = c;
+  if (con_len[pid] == CON_BUF) {
+    con_flush(pid);
+  }
+}
+
+// Appends whatever stdin has ready to con_in, waiting for it only if block
+// is set. Unconsumed input is moved to the front first.
+static void con_fill(bool block) {
+  if (con_eof) {
+    return;
+  }
+  if (con_pos > 0) {
+    memmove(con_in, con_in + con_pos, con_end - con_pos);
+    con_end -= con_pos;
+    con_pos = 0;
+  }
+  if (con_end == CON_BUF) {
+    return;
+  }
+  struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+  if (!block && poll(&fd, 1, 0) <= 0) {
+    return;
+  }
+  ssize_t n = read(STDIN_FILENO, con_in + con_end, CON_BUF - con_end);
+  if (n <= 0) {
+    con_eof = true;
+  } else {
+    con_end += n;
+  }
+}
+
+// Whether a live process other than pid is not waiting for input or in WAIT
+static bool con_others(uint16_t pid) {
+  for (uint16_t p = 0; p < mem[Proc_Count]; p++) {
+    if (p != pid && mem[PCB_ADDR(p) + PID_PCB] != 0xffff && !con_blocked[p] && wait_key[p] == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs parse over the input read ahead until it has enough of it. parse
+// returns the bytes it consumed and stores the value in *val, or -1 while the
+// input ends too early to decide. Returns CON_AGAIN instead when the process
+// has been descheduled to wait for input; the trap then runs again once the
+// process is back.
+typedef int (*con_parse_f)(const char *buf, size_t len, bool eof, int *val);
+static int con_read(con_parse_f parse, int *val) {
+  uint16_t pid = CUR_PID;
+  OS_LOCK(con_lock);
+  for (;;) {
+    int n = parse(con_in + con_pos, con_end - con_pos, con_eof, val);
+    if (n >= 0) {
+      con_pos += n;
+      if (pid < MAX_PROCS) {
+        con_blocked[pid] = false;
+      }
+      OS_UNLOCK(con_lock);
+      return n;
+    }
+    size_t ready = con_end - con_pos;
+    con_fill(false);
+    if (con_end - con_pos > ready || con_eof) {
+      continue;
+    }
+    if (pid < MAX_PROCS && con_others(pid)) {
+      con_blocked[pid] = true;
+#if defined(VM_RUNQ) && !defined(VM_PARALLEL)
+      rq_remove(pid);
+#endif
+      OS_UNLOCK(con_lock);
+      reg[RPC]--;
+      tyld();
+      return CON_AGAIN;
+    }
+    con_fill(true);
+  }
+}
+
+#ifndef VM_PARALLEL
+// Makes the processes waiting for input runnable again once more of it was
+// read ahead, waiting on stdin first if block is set. Returns whether any was
+// woken.
+static bool con_wake(bool block) {
+  bool blocked = false;
+  for (uint16_t p = 0; p < mem[Proc_Count]; p++) {
+    blocked |= con_blocked[p];
+  }
+  if (!blocked) {
+    return false;
+  }
+  size_t ready = con_end - con_pos;
+  con_fill(block);
+  if (con_end - con_pos == ready && !con_eof) {
+    return false;
+  }
+  for (uint16_t p = 0; p < mem[Proc_Count]; p++) {
+    if (con_blocked[p]) {
+      con_blocked[p] = false;
+#ifdef VM_RUNQ
+      rq_insert(p);
+#endif
+    }
+  }
+  return true;
+}
+#endif
+
+// One byte, EOF like getchar() at the end of stdin
+static int con_parse_char(const char *buf, size_t len, bool eof, int *val) {
+  if (len == 0) {
+    *val = EOF;
+    return eof ? 0 : -1;
+  }
+  *val = (unsigned char)buf[0];
+  return 1;
+}
+
+// The conversion of fscanf("%hu"): white space, an optional sign and digits.
+// The byte after the number tells where it ends. *val is -1 when there is no
+// number, and then only the white space is consumed.
+static int con_parse_u16(const char *buf, size_t len, bool eof, int *val) {
+  size_t k = 0;
+  while (k < len && (buf[k] == ' ' || (buf[k] >= '\t' && buf[k] <= '\r'))) {
+    k++;
+  }
+  size_t start = k;
+  bool neg = k < len && buf[k] == '-';
+  if (k < len && (buf[k] == '-' || buf[k] == '+')) {
+    k++;
+  }
+  size_t digits = k;
+  uint16_t v = 0;
+  while (k < len && buf[k] >= '0' && buf[k] <= '9') {
+    v = v * 10 + (buf[k++] - '0');
+  }
+  if (k == len && !eof && len < CON_BUF) {
+    return -1;
+  }
+  if (k == digits) {
+    *val = -1;
+    return start;
+  }
+  *val = (uint16_t)(neg ? -v : v);
+  return k;
+}
+
+static inline void tgetc() {
+  int c;
+  if (con_read(con_parse_char, &c) != CON_AGAIN) {
+    reg[R0] = c;
+  }
+}
+static inline void tout() { con_putc((char)reg[R0]); }
+static inline void tputs() {
+  uint16_t *p = mem + reg[R0];
+  while(*p) {
+    con_putc((char) *p);
+    p++;
+  }
+}
+static inline void tin() {
+  int c;
+  if (con_read(con_parse_char, &c) != CON_AGAIN) {
+    reg[R0] = c;
+    con_putc((char)reg[R0]);
+  }
+}
+static inline void tputsp()   { /* Not Implemented */ }
+static inline void tinu16() {
+  int v;
+  if (con_read(con_parse_u16, &v) != CON_AGAIN && v >= 0) {
+    reg[R0] = v;
+  }
+}
+static inline void toutu16() {
+  char buf[8];
+  int n = 0;
+  uint16_t v = reg[R0];
+  do {
+    buf[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n) {
+    con_putc(buf[--n]);
+  }
+  con_putc('\n');
+}
+#else
 static inline void tgetc()        { reg[R0] = getchar(); }
-static inline void tout()         { fprintf(stdout, "%c", (char)reg[R0]); }
+static inline void tout()         { fprintf(vm_out, "%c", (char)reg[R0]); }
 static inline void tputs() {
   uint16_t *p = mem + reg[R0];
   while(*p) {
-    fprintf(stdout, "%c", (char) *p);
+    fprintf(vm_out, "%c", (char) *p);
     p++;
   }
 }
-static inline void tin()      { reg[R0] = getchar(); fprintf(stdout, "%c", reg[R0]); }
+static inline void tin()      { reg[R0] = getchar(); fprintf(vm_out, "%c", reg[R0]); }
 static inline void tputsp()   { /* Not Implemented */ }
 static inline void tinu16()   { fscanf(stdin, "%hu", &reg[R0]); }
-static inline void toutu16()  { fprintf(stdout, "%hu\n", reg[R0]); }
+static inline void toutu16()  { fprintf(vm_out, "%hu\n", reg[R0]); }
 
-trp_ex_f trp_ex[10] = {tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk};
+#endif
+
+#ifdef VM_TRACE
+// Every trap goes through trace_call(), which runs the handler from trp_run
+#define TRACE_STUB(n) static void trace_stub##n() { trace_call(n); }
+TRACE_STUB(0) TRACE_STUB(1) TRACE_STUB(2) TRACE_STUB(3) TRACE_STUB(4) TRACE_STUB(5) TRACE_STUB(6) TRACE_STUB(7)
+TRACE_STUB(8) TRACE_STUB(9) TRACE_STUB(10) TRACE_STUB(11) TRACE_STUB(12) TRACE_STUB(13) TRACE_STUB(14)
+TRACE_STUB(15)
+trp_ex_f trp_run[16] = {tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk, tfork, tbrkn, tshm, twait, tnotify,
+                        tckpt};
+trp_ex_f trp_ex[16] = {
+  trace_stub0, trace_stub1, trace_stub2, trace_stub3, trace_stub4, trace_stub5, trace_stub6, trace_stub7,
+  trace_stub8, trace_stub9, trace_stub10, trace_stub11, trace_stub12, trace_stub13, trace_stub14, trace_stub15
+};
+#else
+trp_ex_f trp_ex[16] = {tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk, tfork, tbrkn, tshm, twait, tnotify,
+                       tckpt};
+#endif
 static inline void trap(uint16_t i) { trp_ex[TRP(i) - trp_offset](); }
 op_ex_f op_ex[NOPS] = {/*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi, sti, jmp, res, lea, trap};
 
@@ -114,46 +893,1795 @@ op_ex_f op_ex[NOPS] = {/*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi,
   * @param offsets the offsets into memory to load the file
   * @param size the size of the file to load
 */
-void ld_img(char *fname, uint16_t *offsets, uint16_t size) {
+#ifdef VM_MMAP
+// Memory-mapped images. Every object file is mapped once and stays mapped, the
+// loaders copy pages straight out of the mapping instead of going through
+// stdio. img_preload() maps and faults in a whole batch on worker threads.
+typedef struct {
+    char *path;
+    const uint16_t *words;  // NULL for an empty file
+    uint32_t size;          // In words
+} mapped_img;
+
+mapped_img images[2 * MAX_PROCS];
+int image_count = 0;
+int preload_next = 0;  // Next image for a preload worker
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards images and image_count
+
+static void img_open(mapped_img *m) {
+    struct stat st;
+    int fd = open(m->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open file %s.\n", m->path);
+        exit(1);
+    }
+    m->size = st.st_size / sizeof(uint16_t);
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Cannot map file %s.\n", m->path);
+            exit(1);
+        }
+        m->words = p;
+    }
+    close(fd);
+}
+
+// Adds fname to the image table without mapping it. Callers hold image_lock.
+static mapped_img *img_find(const char *fname, bool add) {
+    for (int i = 0; i < image_count; i++) {
+        if (strcmp(images[i].path, fname) == 0) {
+            return &images[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (image_count == 2 * MAX_PROCS) {
+        fprintf(stderr, "Cannot map more than %d images.\n", 2 * MAX_PROCS);
+        exit(1);
+    }
+    mapped_img *m = &images[image_count++];
+    m->path = strcpy(malloc(strlen(fname) + 1), fname);
+    m->words = NULL;
+    m->size = 0;
+    return m;
+}
+
+// Returns the mapping of fname, mapping the file on first use.
+static const mapped_img *img_map(const char *fname) {
+    pthread_mutex_lock(&image_lock);
+    mapped_img *m = img_find(fname, false);
+    if (m == NULL) {
+        m = img_find(fname, true);
+        img_open(m);
+    }
+    pthread_mutex_unlock(&image_lock);
+    return m;
+}
+
+static void *img_preload_worker(void *arg) {
+    for (;;) {
+        int i = __atomic_fetch_add(&preload_next, 1, __ATOMIC_RELAXED);
+        if (i >= image_count) {
+            return NULL;
+        }
+        img_open(&images[i]);
+        // Touch every host page so the copies into mem[] do not fault
+        volatile uint16_t sink = 0;
+        for (uint32_t w = 0; w < images[i].size; w += 2048) {
+            sink ^= images[i].words[w];
+        }
+        (void)sink;
+    }
+}
+
+// Maps every not yet mapped image of paths, on up to one thread per online CPU.
+void img_preload(char **paths, int n) {
+    pthread_mutex_lock(&image_lock);
+    preload_next = image_count;
+    for (int i = 0; i < n; i++) {
+        img_find(paths[i], true);
+    }
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > image_count - preload_next) {
+        workers = image_count - preload_next;
+    }
+
+    pthread_t threads[2 * MAX_PROCS];
+    for (long t = 0; t < workers; t++) {
+        if (pthread_create(&threads[t], NULL, img_preload_worker, NULL) != 0) {
+            fprintf(stderr, "Cannot create loader thread.\n");
+            exit(1);
+        }
+    }
+    for (long t = 0; t < workers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_unlock(&image_lock);
+}
+#endif
+
+void ld_img(char *fname, uint32_t *offsets, uint16_t size) {
+#ifdef VM_MMAP
+    const mapped_img *m = img_map(fname);
+    for (uint32_t s = 0; s < size && s < m->size; s += PAGE_WORDS) {
+        uint16_t writeSize = (size - s) > PAGE_WORDS ? PAGE_WORDS : (size - s);
+        memcpy(mem + offsets[s / PAGE_WORDS], m->words + s, writeSize * sizeof(uint16_t));
+    }
+    return;
+#endif
     FILE *in = fopen(fname, "rb");
     if (NULL == in) {
         fprintf(stderr, "Cannot open file %s.\n", fname);
         exit(1);
     }
 
-    for (uint16_t s = 0; s < size; s += PAGE_SIZE) {
-        uint16_t *p = mem + offsets[s / PAGE_SIZE];
-        uint16_t writeSize = (size - s) > PAGE_SIZE ? PAGE_SIZE : (size - s);
+    for (uint32_t s = 0; s < size; s += PAGE_WORDS) {
+        uint16_t *p = mem + offsets[s / PAGE_WORDS];
+        uint16_t writeSize = (size - s) > PAGE_WORDS ? PAGE_WORDS : (size - s);
         fread(p, sizeof(uint16_t), (writeSize), in);
     }
     
     fclose(in);
 }
 
-void run(char *code, char *heap) {
-  while (running) {
-    uint16_t i = mr(reg[RPC]++);
-    op_ex[OPC(i)](i);
-  }
+#ifdef VM_THREADED
+// Direct-threaded interpreter core (GNU C computed goto). Every handler ends by
+// fetching the next instruction and jumping straight to its label, so there is
+// no indirect call per instruction and the handlers above get inlined.
+static void run_threaded() {
+  static void *op_lbl[NOPS] = {
+    /*0*/ &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+    &&op_rti, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_res, &&op_lea, &&op_trap
+  };
+#ifndef VM_TRACE
+  static void *trp_lbl[16] = {
+    &&trp_getc, &&trp_out, &&trp_puts, &&trp_in, &&trp_putsp,
+    &&trp_halt, &&trp_inu16, &&trp_outu16, &&trp_yld, &&trp_brk, &&trp_fork, &&trp_brkn,
+    &&trp_shm, &&trp_wait, &&trp_notify, &&trp_ckpt
+  };
+#endif
+  uint16_t i;
+
+#define DISPATCH() do { if (!running) return; PREEMPT_CHECK(); i = mr(reg[RPC]++); PREEMPT_TICK(); COUNT_INSN(); PROFILE_INSN(OPC(i)); goto *op_lbl[OPC(i)]; } while (0)
+
+  if (!running) return;
+  i = mr(reg[RPC]++);
+  PREEMPT_TICK();
+  COUNT_INSN();
+  PROFILE_INSN(OPC(i));
+  goto *op_lbl[OPC(i)];
+op_br:   br(i);   DISPATCH();
+op_add:  add(i);  DISPATCH();
+op_ld:   ld(i);   DISPATCH();
+op_st:   st(i);   DISPATCH();
+op_jsr:  jsr(i);  DISPATCH();
+op_and:  and(i);  DISPATCH();
+op_ldr:  ldr(i);  DISPATCH();
+op_str:  str(i);  DISPATCH();
+op_rti:  rti(i);  DISPATCH();
+op_not:  not(i);  DISPATCH();
+op_ldi:  ldi(i);  DISPATCH();
+op_sti:  sti(i);  DISPATCH();
+op_jmp:  jmp(i);  DISPATCH();
+op_res:  res(i);  DISPATCH();
+op_lea:  lea(i);  DISPATCH();
+#ifdef VM_TRACE
+op_trap: trp_ex[TRP(i) - trp_offset](); DISPATCH();  // Through trace_call()
+#else
+op_trap: goto *trp_lbl[TRP(i) - trp_offset];
+
+trp_getc:   tgetc();   DISPATCH();
+trp_out:    tout();    DISPATCH();
+trp_puts:   tputs();   DISPATCH();
+trp_in:     tin();     DISPATCH();
+trp_putsp:  tputsp();  DISPATCH();
+trp_halt:   thalt();   DISPATCH();
+trp_inu16:  tinu16();  DISPATCH();
+trp_outu16: toutu16(); DISPATCH();
+trp_yld:    tyld();    DISPATCH();
+trp_brk:    tbrk();    DISPATCH();
+trp_fork:   tfork();   DISPATCH();
+trp_brkn:   tbrkn();   DISPATCH();
+trp_shm:    tshm();    DISPATCH();
+trp_wait:   twait();   DISPATCH();
+trp_notify: tnotify(); DISPATCH();
+trp_ckpt: tckpt(); DISPATCH();
+#endif
+
+#undef DISPATCH
 }
+#endif
 
-// YOUR CODE STARTS HERE
+#ifdef VM_DCACHE
+#if defined(VM_THREADED)
+#error "VM_DCACHE and VM_THREADED select different interpreter cores"
+#endif
+// Pre-decoded instruction cache for read-only (code) frames. A frame is decoded
+// the first time it is executed from; each word becomes a micro-op with its
+// operand fields extracted and its immediate already sign-extended, and
+// blk_len[] holds the number of micro-ops up to and including the next
+// BR/JMP/JSR/TRAP (or the end of the page) so a whole basic block runs without
+// re-translating the PC.
+typedef struct {
+    uint8_t op;    // Opcode
+    uint8_t a;     // DR, or the condition bits for BR, or FL for JSR
+    uint8_t b;     // SR1 / BaseR
+    uint8_t c;     // SR2, 0xff when the immediate form is used
+    uint16_t imm;  // Sign-extended immediate / PC offset, trap vector index for TRAP
+} uop;
 
-// This function is used to get file size.
-static uint16_t get_file_size(const char *fname) {
-    FILE *file = fopen(fname, "rb");
-    if (!file) {
-        fprintf(stderr, "Cannot open file %s.\n", fname);
-        exit(1);
+#ifdef VM_JIT
+typedef uint32_t (*jit_block)();  // Runs a compiled block, returns the instructions it executed
+#endif
+
+typedef struct {
+    uop u[PAGE_WORDS];
+    uint16_t blk_len[PAGE_WORDS];
+#ifdef VM_JIT
+    jit_block native[PAGE_WORDS];  // Compiled block starting at each word, NULL until it is hot
+    uint8_t heat[PAGE_WORDS];      // Runs of the block starting at each word, up to JIT_HOT
+    uint16_t vpn;                  // Page the blocks are compiled for, their PCs are absolute
+#endif
+#ifdef VM_PARALLEL
+    uint32_t gen;                  // dcache_gen[] of the frame when it was decoded
+#endif
+} dpage;
+
+VM_TLS dpage *dcache[FRAME_COUNT] = {0};  // Indexed by physical frame number
+
+#ifdef VM_PARALLEL
+// Each worker decodes into a cache of its own, so dcache_invalidate() can only
+// free the copy of the worker calling it. It also bumps the generation of the
+// frame, and every other worker decodes the page again when it next runs it.
+// Only frames some worker decoded are bumped, a data page never is.
+uint32_t dcache_gen[FRAME_COUNT];
+bool dcache_used[FRAME_COUNT];  // Set for good by the first decode of the frame
+#define DCACHE_STALE(pfn) (dcache[pfn]->gen != __atomic_load_n(&dcache_gen[pfn], __ATOMIC_ACQUIRE))
+#else
+#define DCACHE_STALE(pfn) (false)
+#endif
+
+static inline bool uop_ends_block(uint8_t op) {
+    return op == 0 || op == 4 || op == 12 || op == 15;  // BR, JSR, JMP, TRAP
+}
+
+static void decode_page(uint16_t pfn) {
+    dpage *d = dcache[pfn];
+    if (d == NULL) {
+        d = dcache[pfn] = malloc(sizeof(dpage));
+        if (d == NULL) {
+            fprintf(stderr, "Cannot allocate decode cache.\n");
+            exit(1);
+        }
     }
-    fseek(file, 0, SEEK_END);
-    long bytes = ftell(file);
-    fclose(file);
-    // Divide by 2 (sizeof(uint16_t)) so ld_img reads
-    // exactly that many 16-bit words, not bytes.
-    return (uint16_t)(bytes / sizeof(uint16_t));
+#ifdef VM_PARALLEL
+    if (!__atomic_load_n(&dcache_used[pfn], __ATOMIC_RELAXED)) {
+        __atomic_store_n(&dcache_used[pfn], true, __ATOMIC_SEQ_CST);  // Seen by every later store
+    }
+    d->gen = __atomic_load_n(&dcache_gen[pfn], __ATOMIC_ACQUIRE);  // Read before the words it covers
+#endif
+
+    for (int off = 0; off < PAGE_WORDS; off++) {
+        uint16_t i = mem[FRAME_ADDR(pfn) + off];
+        uop *u = &d->u[off];
+        u->op = OPC(i);
+        u->a = DR(i);
+        u->b = SR1(i);
+        u->c = FIMM(i) ? 0xff : SR2(i);
+        switch (u->op) {
+            case 0: case 2: case 3: case 10: case 11: case 14: u->imm = POFF9(i); break;
+            case 1: case 5: u->imm = SEXTIMM(i); break;
+            case 4: u->a = FL(i); u->imm = POFF11(i); break;
+            case 6: case 7: u->imm = POFF(i); break;
+            case 15: u->imm = TRP(i) - trp_offset; break;
+            default: u->imm = 0; break;
+        }
+    }
+
+    for (int off = PAGE_WORDS - 1; off >= 0; off--) {
+        if (off == PAGE_WORDS - 1 || uop_ends_block(d->u[off].op)) {
+            d->blk_len[off] = 1;
+        } else {
+            d->blk_len[off] = d->blk_len[off + 1] + 1;
+        }
+    }
+}
+
+// Drop the decoded form of a frame, used when it is freed or written.
+static inline void dcache_invalidate(uint16_t pfn) {
+#ifdef VM_PARALLEL
+    // Orders the store to the frame before the check, against decode_page()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&dcache_used[pfn], __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&dcache_gen[pfn], 1, __ATOMIC_RELEASE);
+    }
+#endif
+    if (dcache[pfn]) {
+        free(dcache[pfn]);
+        dcache[pfn] = NULL;
+    }
+}
+
+static inline void exec_uop(const uop *u) {
+    switch (u->op) {
+        case 0:  if (reg[RCND] & u->a) { reg[RPC] += u->imm; } break;
+        case 1:  reg[u->a] = reg[u->b] + (u->c == 0xff ? u->imm : reg[u->c]); uf(u->a); break;
+        case 2:  reg[u->a] = mr(reg[RPC] + u->imm); uf(u->a); break;
+        case 3:  mw(reg[RPC] + u->imm, reg[u->a]); break;
+        case 4:  reg[R7] = reg[RPC]; reg[RPC] = u->a ? reg[RPC] + u->imm : reg[u->b]; break;
+        case 5:  reg[u->a] = reg[u->b] & (u->c == 0xff ? u->imm : reg[u->c]); uf(u->a); break;
+        case 6:  reg[u->a] = mr(reg[u->b] + u->imm); uf(u->a); break;
+        case 7:  mw(reg[u->b] + u->imm, reg[u->a]); break;
+        case 9:  reg[u->a] = ~reg[u->b]; uf(u->a); break;
+        case 10: reg[u->a] = mr(mr(reg[RPC] + u->imm)); uf(u->a); break;
+        case 11: mw(mr(reg[RPC] + u->imm), reg[u->a]); break;
+        case 12: reg[RPC] = reg[u->b]; break;
+        case 14: reg[u->a] = reg[RPC] + u->imm; uf(u->a); break;
+        case 15: trp_ex[u->imm](); break;
+        default: break;  // RTI and the reserved opcode are unused
+    }
+}
+
+#ifdef VM_JIT
+// Template JIT. Once a block of a decoded page has been run JIT_HOT times it
+// is translated to x86-64 code doing what the uops do on reg[] in memory,
+// except that condition codes are only stored when a later instruction or the
+// caller can see them. Loads, stores and traps call mr(), mw() and trp_ex[],
+// with reg[RPC] set as the interpreter would have it, and the block returns
+// early when one of them clears running. Every frame has an executable arena
+// for its blocks that is reused when the page is decoded again, which only
+// happens once dcache_invalidate() dropped every block compiled into it.
+#ifndef JIT_HOT
+#define JIT_HOT       (16)                // Runs of a block before it is compiled
+#endif
+#define JIT_ARENA     (PAGE_WORDS * 48)   // Bytes of native code per frame
+#define JIT_INSN_MAX  (96)                // Longest translation of one instruction
+#define JIT_REG(r)    (2 * (r))           // Displacement of reg[r] from rbx
+
+VM_CTX uint8_t *jit_code[FRAME_COUNT];  // Arena of each frame, mapped on first use
+VM_CTX uint32_t jit_used[FRAME_COUNT];  // Bytes of it holding blocks
+VM_CTX uint64_t jit_blocks = 0;         // Blocks compiled
+VM_CTX uint64_t jit_insns = 0;          // Instructions executed by compiled blocks
+
+// Forgets the blocks of a freshly decoded page, which is mapped at vpn
+static void jit_reset(uint16_t pfn, uint16_t vpn) {
+    memset(dcache[pfn]->native, 0, sizeof(dcache[pfn]->native));
+    memset(dcache[pfn]->heat, 0, sizeof(dcache[pfn]->heat));
+    dcache[pfn]->vpn = vpn;
+    jit_used[pfn] = 0;
+}
+
+static inline void jit_u8(uint8_t **p, uint8_t b) { *(*p)++ = b; }
+static inline void jit_u16(uint8_t **p, uint16_t v) { memcpy(*p, &v, 2); *p += 2; }
+static inline void jit_u32(uint8_t **p, uint32_t v) { memcpy(*p, &v, 4); *p += 4; }
+static inline void jit_u64(uint8_t **p, uint64_t v) { memcpy(*p, &v, 8); *p += 8; }
+
+static void jit_bytes(uint8_t **p, const char *b, int n) {
+    memcpy(*p, b, n);
+    *p += n;
+}
+
+// movzx host, word [rbx + reg r]. Host registers: 0 eax, 1 ecx, 6 esi, 7 edi
+static void jit_load(uint8_t **p, int host, int r) {
+    jit_bytes(p, "\x0f\xb7", 2);
+    jit_u8(p, 0x43 | host << 3);
+    jit_u8(p, JIT_REG(r));
+}
+
+// mov word [rbx + reg r], host
+static void jit_store(uint8_t **p, int host, int r) {
+    jit_bytes(p, "\x66\x89", 2);
+    jit_u8(p, 0x43 | host << 3);
+    jit_u8(p, JIT_REG(r));
+}
+
+// mov word [rbx + reg r], v
+static void jit_store_imm(uint8_t **p, int r, uint16_t v) {
+    jit_bytes(p, "\x66\xc7\x43", 3);
+    jit_u8(p, JIT_REG(r));
+    jit_u16(p, v);
+}
+
+// reg[RCND] from the value in ax, as uf() sets it
+static void jit_flags(uint8_t **p) {
+    jit_bytes(p, "\x66\x85\xc0", 3);                // test ax, ax
+    jit_bytes(p, "\xb9\x01\x00\x00\x00", 5);        // mov ecx, FP
+    jit_bytes(p, "\xba\x02\x00\x00\x00", 5);        // mov edx, FZ
+    jit_bytes(p, "\x0f\x44\xca", 3);                // cmovz ecx, edx
+    jit_bytes(p, "\xba\x04\x00\x00\x00", 5);        // mov edx, FN
+    jit_bytes(p, "\x0f\x48\xca", 3);                // cmovs ecx, edx
+    jit_store(p, 1, RCND);
+}
+
+// Calls f with the arguments in edi and esi
+static void jit_call(uint8_t **p, void *f) {
+    jit_bytes(p, "\x48\xb8", 2);                    // mov rax, f
+    jit_u64(p, (uint64_t)(uintptr_t)f);
+    jit_bytes(p, "\xff\xd0", 2);                    // call rax
+}
+
+static void jit_ret(uint8_t **p, uint32_t n) {
+    jit_u8(p, 0xb8);                                // mov eax, n
+    jit_u32(p, n);
+    jit_bytes(p, "\x41\x5d\x41\x5c\x5b\xc3", 6);    // pop r13, pop r12, pop rbx, ret
+}
+
+// Returns n from the block if running was cleared
+static void jit_check(uint8_t **p, uint32_t n) {
+    jit_bytes(p, "\x41\x80\x3c\x24\x00", 5);        // cmp byte [r12], 0
+    jit_bytes(p, "\x75\x0b", 2);                    // jne over the return
+    jit_ret(p, n);
+}
+
+// edi = reg[r] + imm as a 16-bit address
+static void jit_addr(uint8_t **p, int r, uint16_t imm) {
+    jit_load(p, 7, r);
+    jit_bytes(p, "\x81\xc7", 2);                    // add edi, imm
+    jit_u32(p, (int32_t)(int16_t)imm);
+    jit_bytes(p, "\x0f\xb7\xff", 3);                // movzx edi, di
+}
+
+static void jit_mov_edi(uint8_t **p, uint16_t v) {
+    jit_u8(p, 0xbf);                                // mov edi, v
+    jit_u32(p, v);
+}
+
+static uint16_t jit_cc(uint16_t v) {
+    return v == 0 ? FZ : (v >> 15) ? FN : FP;
 }
 
+// Compiles the block of frame pfn starting at word off. Returns NULL when the
+// arena is full or cannot be mapped, the block is then left to the interpreter.
+static jit_block jit_compile(uint16_t pfn, uint16_t off) {
+    dpage *d = dcache[pfn];
+    const uop *u = &d->u[off];
+    uint16_t n = d->blk_len[off];
+    if (u[n - 1].op == 15 && u[n - 1].imm >= sizeof(trp_ex) / sizeof(trp_ex[0])) {
+        return NULL;
+    }
+    if (jit_code[pfn] == NULL) {
+        void *m = mmap(NULL, JIT_ARENA, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            return NULL;
+        }
+        jit_code[pfn] = m;
+    }
+    if (jit_used[pfn] + 64 + (uint32_t)n * JIT_INSN_MAX > JIT_ARENA) {
+        return NULL;
+    }
+
+    // Condition codes an instruction sets are dead if a later one of the block
+    // sets them again before anything can read them
+    bool cc[PAGE_WORDS];
+    bool live = true;
+    for (int k = n - 1; k >= 0; k--) {
+        switch (u[k].op) {
+            case 2: case 6: case 10: cc[k] = true; live = false; break;  // Returns from a fault with them set
+            case 1: case 5: case 9: case 14: cc[k] = live; live = false; break;
+            case 0: case 3: case 7: case 11: case 15: cc[k] = false; live = true; break;
+            default: cc[k] = false; break;
+        }
+    }
+
+    uint8_t *start = jit_code[pfn] + jit_used[pfn];
+    uint8_t *p = start;
+    jit_bytes(&p, "\x53\x41\x54\x41\x55", 5);       // push rbx, push r12, push r13
+    jit_bytes(&p, "\x48\xbb", 2);                   // mov rbx, reg
+    jit_u64(&p, (uint64_t)(uintptr_t)reg);
+    jit_bytes(&p, "\x49\xbc", 2);                   // mov r12, &running
+    jit_u64(&p, (uint64_t)(uintptr_t)&running);
+
+    uint16_t pc = (d->vpn << PAGE_SHIFT) + off;
+    for (int k = 0; k < n; k++) {
+        uint16_t npc = pc + k + 1;  // reg[RPC] while the instruction runs
+        const uop *v = &u[k];
+        switch (v->op) {
+            case 0:  // BR
+                jit_store_imm(&p, RPC, npc);
+                if (v->a) {
+                    jit_load(&p, 0, RCND);
+                    jit_u8(&p, 0xa8);               // test al, nzp
+                    jit_u8(&p, v->a);
+                    jit_bytes(&p, "\x74\x06", 2);   // jz over the store
+                    jit_store_imm(&p, RPC, npc + v->imm);
+                }
+                break;
+            case 1:  // ADD
+            case 5:  // AND
+                jit_load(&p, 0, v->b);
+                if (v->c == 0xff) {
+                    jit_u8(&p, v->op == 1 ? 0x05 : 0x25);  // add/and eax, imm
+                    jit_u32(&p, (int32_t)(int16_t)v->imm);
+                } else {
+                    jit_load(&p, 1, v->c);
+                    jit_u8(&p, v->op == 1 ? 0x01 : 0x21);  // add/and eax, ecx
+                    jit_u8(&p, 0xc8);
+                }
+                jit_store(&p, 0, v->a);
+                if (cc[k]) {
+                    jit_flags(&p);
+                }
+                break;
+            case 2:  // LD
+            case 10: // LDI
+                jit_store_imm(&p, RPC, npc);
+                jit_mov_edi(&p, npc + v->imm);
+                jit_call(&p, mr);
+                if (v->op == 10) {
+                    jit_bytes(&p, "\x0f\xb7\xf8", 3);  // movzx edi, ax
+                    jit_call(&p, mr);
+                }
+                jit_store(&p, 0, v->a);
+                jit_flags(&p);
+                jit_check(&p, k + 1);
+                break;
+            case 3:  // ST
+            case 11: // STI
+                jit_store_imm(&p, RPC, npc);
+                jit_mov_edi(&p, npc + v->imm);
+                if (v->op == 11) {
+                    jit_call(&p, mr);
+                    jit_bytes(&p, "\x0f\xb7\xf8", 3);  // movzx edi, ax
+                }
+                jit_load(&p, 6, v->a);
+                jit_call(&p, mw);
+                jit_check(&p, k + 1);
+                break;
+            case 4:  // JSR, R7 first as in jsr() so JSRR R7 jumps to the return address
+                jit_store_imm(&p, R7, npc);
+                if (v->a) {
+                    jit_store_imm(&p, RPC, npc + v->imm);
+                } else {
+                    jit_load(&p, 0, v->b);
+                    jit_store(&p, 0, RPC);
+                }
+                break;
+            case 6:  // LDR
+                jit_store_imm(&p, RPC, npc);
+                jit_addr(&p, v->b, v->imm);
+                jit_call(&p, mr);
+                jit_store(&p, 0, v->a);
+                jit_flags(&p);
+                jit_check(&p, k + 1);
+                break;
+            case 7:  // STR
+                jit_store_imm(&p, RPC, npc);
+                jit_addr(&p, v->b, v->imm);
+                jit_load(&p, 6, v->a);
+                jit_call(&p, mw);
+                jit_check(&p, k + 1);
+                break;
+            case 9:  // NOT
+                jit_load(&p, 0, v->b);
+                jit_bytes(&p, "\xf7\xd0", 2);   // not eax
+                jit_store(&p, 0, v->a);
+                if (cc[k]) {
+                    jit_flags(&p);
+                }
+                break;
+            case 12: // JMP
+                jit_load(&p, 0, v->b);
+                jit_store(&p, 0, RPC);
+                break;
+            case 14: // LEA
+                jit_store_imm(&p, v->a, npc + v->imm);
+                if (cc[k]) {
+                    jit_store_imm(&p, RCND, jit_cc(npc + v->imm));
+                }
+                break;
+            case 15: // TRAP, it may switch processes so the block ends with it
+                jit_store_imm(&p, RPC, npc);
+                jit_call(&p, trp_ex[v->imm]);
+                break;
+            default: // RTI and the reserved opcode are unused
+                break;
+        }
+    }
+    uint8_t last = u[n - 1].op;
+    if (last != 0 && last != 4 && last != 12 && last != 15) {
+        jit_store_imm(&p, RPC, pc + n);  // Runs into the next page
+    }
+    jit_ret(&p, n);
+
+    jit_used[pfn] += p - start;
+    jit_blocks++;
+    return (jit_block)start;
+}
+#endif
+
+static void run_decoded() {
+  while (running) {
+    uint16_t vpn = reg[RPC] >> PAGE_SHIFT;
+    uint16_t pte = (vpn < CODE_VPN) ? 0 : tlb_lookup(vpn);
+
+    // Only valid, read-only pages are decoded. Anything else (including every
+    // faulting fetch) goes through the regular mr()/op_ex path. A copy-on-write
+    // page is read-only too, but a store into it would free the block running,
+    // and so would a store through a writable mapping of a shared region.
+    if ((pte & (PTE_VALID | PTE_READ | PTE_WRITE | PTE_COW)) != (PTE_VALID | PTE_READ) ||
+        frame_shm[PTE_PFN(pte)]) {
+      uint16_t i = mr(reg[RPC]++);
+      PREEMPT_TICK();
+      COUNT_INSN();
+      PROFILE_INSN(OPC(i));
+      op_ex[OPC(i)](i);
+      PREEMPT_CHECK();
+      continue;
+    }
+
+    uint16_t pfn = PTE_PFN(pte);
+    if (dcache[pfn] == NULL || DCACHE_STALE(pfn)) {
+      decode_page(pfn);
+#ifdef VM_JIT
+      jit_reset(pfn, vpn);
+#endif
+    }
+
+    uint16_t off = reg[RPC] & OFFSET_MASK;
+#ifdef VM_JIT
+    dpage *d = dcache[pfn];
+    if (d->vpn == vpn && d->native[off] == NULL && d->heat[off] < JIT_HOT && ++d->heat[off] == JIT_HOT) {
+      d->native[off] = jit_compile(pfn, off);
+    }
+    if (d->vpn == vpn && d->native[off] != NULL) {
+      uint32_t n = d->native[off]();  // May free d
+      jit_insns += n;
+#if defined(VM_STATS) || defined(VM_BENCH)
+      insn_count += n;
+#endif
+#ifdef VM_PREEMPT
+      ticks += n;
+      if (ticks >= slice_end && running) {
+        tpreempt();
+      }
+#endif
+      continue;
+    }
+#endif
+    const uop *u = &dcache[pfn]->u[off];
+    for (uint16_t n = dcache[pfn]->blk_len[off]; n > 0 && running; n--, u++) {
+      reg[RPC]++;
+      PREEMPT_TICK();
+      COUNT_INSN();
+      PROFILE_INSN(u->op);
+      exec_uop(u);
+    }
+
+#ifdef VM_PREEMPT
+    // Preemption is checked at block boundaries, the rest of a block always
+    // belongs to the process that started it
+    if (ticks >= slice_end && running) {
+      tpreempt();
+    }
+#endif
+  }
+}
+#endif
+
+// Executes the current guest until running is cleared
+static void run_core() {
+#ifdef VM_THREADED
+  run_threaded();
+#elif defined(VM_DCACHE)
+  run_decoded();
+#else
+  while (running) {
+    uint16_t i = mr(reg[RPC]++);
+    PREEMPT_TICK();
+    COUNT_INSN();
+    PROFILE_INSN(OPC(i));
+    op_ex[OPC(i)](i);
+    PREEMPT_CHECK();
+  }
+#endif
+}
+
+#ifdef VM_PARALLEL
+// Parallel execution mode. Guests are handed to a pool of host worker threads
+// through a shared FIFO ready queue. A worker runs one guest at a time on its
+// own register file until the guest yields (it goes to the back of the queue)
+// or halts. A fault in any guest stops every worker, like it stops run() in
+// the single-threaded mode.
+uint16_t ready_q[MAX_PROCS];
+int ready_head = 0;
+int ready_count = 0;
+int live_procs = 0;                   // Guests that have not halted yet
+bool stop_all = false;
+bool *worker_running[MAX_PROCS];      // running of each worker, cleared by stop_all
+int worker_count = 0;
+uint16_t last_pid = 0xffff;           // Guest that finished last
+uint64_t tlb_hits_all = 0;
+uint64_t tlb_misses_all = 0;
+#if defined(VM_STATS) || defined(VM_BENCH)
+uint64_t insn_count_all = 0;
+uint64_t switch_count_all = 0;
+#endif
+pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards everything above
+pthread_cond_t sched_cv = PTHREAD_COND_INITIALIZER;
+
+// Sets stop_all and stops the guests the other workers are running at their
+// next instruction. The caller holds sched_lock.
+static void stop_workers() {
+  stop_all = true;
+  for (int w = 0; w < worker_count; w++) {
+    if (worker_running[w] != NULL) {
+      __atomic_store_n(worker_running[w], false, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void *guest_worker(void *arg) {
+  pthread_mutex_lock(&sched_lock);
+  int slot = worker_count++;
+  worker_running[slot] = &running;
+  pthread_mutex_unlock(&sched_lock);
+
+  for (;;) {
+    pthread_mutex_lock(&sched_lock);
+    while (ready_count == 0 && live_procs > 0 && !stop_all) {
+      pthread_cond_wait(&sched_cv, &sched_lock);
+    }
+    if (ready_count == 0 || stop_all) {
+      pthread_mutex_unlock(&sched_lock);
+      break;
+    }
+    uint16_t pid = ready_q[ready_head];
+    ready_head = (ready_head + 1) % MAX_PROCS;
+    ready_count--;
+    running = true;  // Under the lock, stop_workers() cannot be undone
+    pthread_mutex_unlock(&sched_lock);
+
+    // Switch this worker to the guest's context
+    cur_pid = pid;
+    memcpy(reg, guest_reg[pid], sizeof(reg));
+    reg[PTBR] = mem[PCB_ADDR(pid) + PTBR_PCB];
+    reg[RPC] = mem[PCB_ADDR(pid) + PC_PCB];
+    tlb_flush();
+    yielded = false;
+
+    run_core();
+
+    memcpy(guest_reg[pid], reg, sizeof(reg));
+    pthread_mutex_lock(&sched_lock);
+    if (yielded) {
+      ready_q[(ready_head + ready_count) % MAX_PROCS] = pid;
+      ready_count++;
+    } else if (!stop_all) {
+      live_procs--;
+      last_pid = pid;
+      if (mem[PCB_ADDR(pid) + PID_PCB] != 0xffff) {
+        stop_workers();  // Stopped without halting: the guest faulted
+      }
+    }  // Otherwise stopped by the fault of another guest, which last_pid keeps
+    pthread_cond_broadcast(&sched_cv);
+    pthread_mutex_unlock(&sched_lock);
+  }
+
+  pthread_mutex_lock(&sched_lock);
+  worker_running[slot] = NULL;
+  tlb_hits_all += tlb_hits;
+  tlb_misses_all += tlb_misses;
+#if defined(VM_STATS) || defined(VM_BENCH)
+  insn_count_all += insn_count;
+  switch_count_all += switch_count;
+#endif
+  pthread_mutex_unlock(&sched_lock);
+  return NULL;
+}
+
+// Runs every created guest on VM_WORKERS host threads (default: one per
+// online CPU) and leaves the context of the guest that finished last in
+// reg, as the single-threaded run() does.
+static void run_parallel() {
+  worker_count = 0;
+  for (uint16_t pid = 0; pid < mem[1]; pid++) {
+    if (mem[PCB_ADDR(pid) + PID_PCB] != 0xffff) {
+      ready_q[ready_count++] = pid;
+    }
+  }
+  live_procs = ready_count;
+
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  char *env = getenv("VM_WORKERS");
+  if (env != NULL) {
+    workers = atol(env);
+  }
+  if (workers > live_procs) {
+    workers = live_procs;
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+
+  pthread_t threads[MAX_PROCS];
+  for (long t = 0; t < workers; t++) {
+    if (pthread_create(&threads[t], NULL, guest_worker, NULL) != 0) {
+      fprintf(stderr, "Cannot create worker thread.\n");
+      exit(1);
+    }
+  }
+  for (long t = 0; t < workers; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  tlb_hits += tlb_hits_all;
+  tlb_misses += tlb_misses_all;
+#if defined(VM_STATS) || defined(VM_BENCH)
+  insn_count += insn_count_all;
+  switch_count += switch_count_all;
+#endif
+  if (last_pid != 0xffff) {
+    memcpy(reg, guest_reg[last_pid], sizeof(reg));
+    mem[0] = last_pid;
+  }
+  running = false;
+}
+#endif
+
+#ifdef VM_PREEMPT
+static void sched_init() {
+  if (sched_resume) {
+    sched_resume = false;  // The snapshot brought the policy and the clock along
+    return;
+  }
+  char *env = getenv("VM_QUANTUM");
+  if (env != NULL && atol(env) > 0) {
+    quantum = atol(env);
+  }
+  env = getenv("VM_SCHED");
+  sched_mlfq = env != NULL && strcmp(env, "mlfq") == 0;
+
+  ticks = 0;
+  memset(proc_run, 0, sizeof(proc_run));  // The accounting restarts with the clock
+  memset(proc_wait, 0, sizeof(proc_wait));
+  memset(proc_since, 0, sizeof(proc_since));
+  next_boost = (uint64_t)quantum * MLFQ_BOOST;
+  slice_end = quantum;
+}
+
+static void sched_report() {
+  uint16_t cur = mem[0];
+  if (running == 0 && cur < mem[1] && mem[PCB_ADDR(cur) + PID_PCB] != 0xffff) {
+    proc_run[cur] += ticks - proc_since[cur];  // Stopped by a fault while running
+    proc_since[cur] = ticks;
+  }
+
+  fprintf(stderr, "Scheduler: %s, quantum %u, %llu instructions\n",
+          sched_mlfq ? "mlfq" : "round-robin", quantum, (unsigned long long)ticks);
+  for (uint16_t pid = 0; pid < mem[1]; pid++) {
+    fprintf(stderr, "pid %d: runtime %llu, wait %llu, level %d\n", pid,
+            (unsigned long long)proc_run[pid], (unsigned long long)proc_wait[pid], proc_level[pid]);
+  }
+}
+#endif
+
+#ifdef VM_PROFILE
+// Instruction profiler. Every prof_period-th instruction is attributed to the
+// pid and PC executing it; exact counting (the default) samples them all.
+// run() prints a report sorted by count to stderr and, with VM_PROFILE_CSV
+// set, writes every counter as kind,pid,key,count rows to that file.
+static const char *op_names[NOPS] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR", "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+typedef struct {
+  uint16_t pid;
+  uint16_t pc;
+  uint32_t count;
+} prof_spot;
+
+static void prof_sample(uint8_t op) {
+  uint16_t pid = CUR_PID;
+  prof_countdown = prof_period;
+  if (pid >= MAX_PROCS) {
+    return;
+  }
+  if (prof_pc[pid] == NULL && (prof_pc[pid] = calloc(0x10000, sizeof(uint32_t))) == NULL) {
+    fprintf(stderr, "Cannot allocate profile counters.\n");
+    exit(1);
+  }
+  prof_pc[pid][(uint16_t)(reg[RPC] - 1)]++;
+  prof_op[pid][op]++;
+}
+
+static void prof_init() {
+  char *env = getenv("VM_PROFILE_SAMPLE");
+  if (env != NULL && atol(env) > 0) {
+    prof_period = atol(env);
+  }
+  prof_countdown = 1;
+}
+
+static int prof_spot_cmp(const void *a, const void *b) {
+  const prof_spot *x = a, *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->pid != y->pid ? x->pid - y->pid : x->pc - y->pc;
+}
+
+static void prof_report() {
+  uint64_t op_total[NOPS] = {0};
+  uint64_t total = 0;
+  size_t spots = 0;
+  for (int pid = 0; pid < MAX_PROCS; pid++) {
+    for (int op = 0; op < NOPS; op++) {
+      op_total[op] += prof_op[pid][op];
+      total += prof_op[pid][op];
+    }
+    for (uint32_t pc = 0; prof_pc[pid] && pc < 0x10000; pc++) {
+      spots += prof_pc[pid][pc] != 0;
+    }
+  }
+
+  prof_spot *spot = malloc((spots + 1) * sizeof(prof_spot));
+  size_t n = 0;
+  for (int pid = 0; pid < MAX_PROCS; pid++) {
+    for (uint32_t pc = 0; prof_pc[pid] && pc < 0x10000; pc++) {
+      if (prof_pc[pid][pc]) {
+        spot[n++] = (prof_spot){pid, pc, prof_pc[pid][pc]};
+      }
+    }
+  }
+  qsort(spot, n, sizeof(prof_spot), prof_spot_cmp);
+
+  // Counts are scaled back up by the sampling period
+  fprintf(stderr, "Profile: %llu instructions, sampled every %u\n",
+          (unsigned long long)total * prof_period, prof_period);
+  bool done[NOPS] = {false};
+  for (int k = 0; k < NOPS; k++) {
+    int best = -1;
+    for (int op = 0; op < NOPS; op++) {
+      if (!done[op] && (best == -1 || op_total[op] > op_total[best])) {
+        best = op;
+      }
+    }
+    done[best] = true;
+    if (op_total[best]) {
+      fprintf(stderr, "  %-4s %10llu %5.1f%%\n", op_names[best],
+              (unsigned long long)op_total[best] * prof_period, 100.0 * op_total[best] / total);
+    }
+  }
+  fprintf(stderr, "Hot spots:\n");
+  for (size_t k = 0; k < n && k < 16; k++) {
+    fprintf(stderr, "  pid %d x%04X %10llu %5.1f%%\n", spot[k].pid, spot[k].pc,
+            (unsigned long long)spot[k].count * prof_period, 100.0 * spot[k].count / total);
+  }
+  for (int pid = 0; pid < mem[Proc_Count]; pid++) {
+    uint64_t insns = 0;
+    for (int op = 0; op < NOPS; op++) {
+      insns += prof_op[pid][op];
+    }
+    fprintf(stderr, "pid %d: %llu instructions, %llu traps, %llu faults, %llu switches\n", pid,
+            (unsigned long long)insns * prof_period, (unsigned long long)prof_op[pid][15] * prof_period,
+            (unsigned long long)prof_faults[pid], (unsigned long long)prof_switches[pid]);
+  }
+
+  char *path = getenv("VM_PROFILE_CSV");
+  FILE *csv = path ? fopen(path, "w") : NULL;
+  if (path && csv == NULL) {
+    fprintf(stderr, "Cannot open file %s.\n", path);
+  }
+  if (csv) {
+    fprintf(csv, "kind,pid,key,count\n");
+    for (size_t k = 0; k < n; k++) {
+      fprintf(csv, "pc,%d,x%04X,%llu\n", spot[k].pid, spot[k].pc, (unsigned long long)spot[k].count * prof_period);
+    }
+    for (int pid = 0; pid < mem[Proc_Count]; pid++) {
+      for (int op = 0; op < NOPS; op++) {
+        if (prof_op[pid][op]) {
+          fprintf(csv, "op,%d,%s,%llu\n", pid, op_names[op], (unsigned long long)prof_op[pid][op] * prof_period);
+        }
+      }
+      fprintf(csv, "fault,%d,,%llu\n", pid, (unsigned long long)prof_faults[pid]);
+      fprintf(csv, "switch,%d,,%llu\n", pid, (unsigned long long)prof_switches[pid]);
+    }
+    fclose(csv);
+  }
+  free(spot);
+}
+#endif
+
+void run(char *code, char *heap) {
+#ifdef VM_PROFILE
+  prof_init();
+#endif
+#ifdef VM_PREEMPT
+  sched_init();
+#endif
+#ifdef VM_TRACE
+  trace_init();
+#endif
+#ifdef VM_PARALLEL
+  run_parallel();
+#else
+  run_core();
+#endif
+#ifdef VM_CONIO
+  for (uint16_t pid = 0; pid < MAX_PROCS; pid++) {
+    con_flush(pid);  // Left by guests that stopped without halting
+  }
+#endif
+#ifdef VM_STATS
+  fprintf(stderr, "TLB hits: %llu, misses: %llu\n",
+          (unsigned long long)tlb_hits, (unsigned long long)tlb_misses);
+  fprintf(stderr, "Instructions: %llu, context switches: %llu\n",
+          (unsigned long long)insn_count, (unsigned long long)switch_count);
+#ifdef VM_DEMAND
+  fprintf(stderr, "Page faults: %llu\n", (unsigned long long)page_faults);
+#endif
+#ifdef VM_SHARE
+  fprintf(stderr, "Shared code pages: %llu\n", (unsigned long long)code_shared);
+#endif
+#ifdef VM_JIT
+  fprintf(stderr, "JIT: %llu blocks compiled, %llu instructions run by them\n",
+          (unsigned long long)jit_blocks, (unsigned long long)jit_insns);
+#endif
+#ifdef VM_RSS
+  for (uint16_t pid = 0; pid < mem[Proc_Count]; pid++) {
+    fprintf(stderr, "pid %d: %d resident pages, peak %d\n", pid, proc_rss[pid], proc_rss_peak[pid]);
+  }
+#endif
+#endif
+#ifdef VM_SWAP
+  fprintf(stderr, "Paging: %s, %llu faults, %llu swap-ins, %llu evictions, %llu write-backs\n",
+          replace_lru ? "lru" : "clock", (unsigned long long)page_faults, (unsigned long long)swap_ins,
+          (unsigned long long)evictions, (unsigned long long)write_backs);
+#endif
+#ifdef VM_PREEMPT
+  sched_report();
+#endif
+#ifdef VM_PROFILE
+  prof_report();
+#endif
+#ifdef VM_TRACE
+  trace_finish();
+#endif
+}
+
+// Snapshots. A snapshot file holds the whole machine: a header with the
+// geometry and the build features it was taken with, the registers and OS
+// globals, every non-zero page of mem[] and the state of the optional
+// subsystems. vm_restore() stands in for initOS() and createProc().
+#define SNAP_MAGIC    (0x4c33)  // "L3"
+#define SNAP_VERSION  (5)
+#define SNAP_END      (0xffff)  // Terminates the page lists
+
+static uint16_t snap_features() {
+    uint16_t f = 0;
+#ifdef VM_DEMAND
+    f |= 0x01;
+#endif
+#ifdef VM_SWAP
+    f |= 0x02;
+#endif
+#ifdef VM_SHARE
+    f |= 0x04;
+#endif
+#ifdef VM_PREEMPT
+    f |= 0x08;
+#endif
+#ifdef VM_PARALLEL
+    f |= 0x10;
+#endif
+#ifdef VM_PT2
+    f |= 0x20;
+#endif
+#ifdef VM_RUNQ
+    f |= 0x40;
+#endif
+#ifdef VM_RSS
+    f |= 0x80;
+#endif
+    return f;
+}
+
+// Writes (out) or reads size bytes at p, false on a short transfer
+static bool snap_io(FILE *f, void *p, size_t size, bool out) {
+    if (size == 0) {
+        return true;
+    }
+    return (out ? fwrite(p, size, 1, f) : fread(p, size, 1, f)) == 1;
+}
+
+#if defined(VM_DEMAND) || defined(VM_SHARE)
+// Length-prefixed string, NULL is stored with length 0
+static bool snap_str(FILE *f, char **s, bool out) {
+    uint16_t len = (out && *s) ? strlen(*s) : 0;
+    if (!snap_io(f, &len, sizeof(len), out)) {
+        return false;
+    }
+    if (!out) {
+        free(*s);
+        *s = NULL;
+        if (len) {
+            *s = malloc(len + 1);
+            (*s)[len] = 0;
+        }
+    }
+    return snap_io(f, *s, len, out);
+}
+#endif
+
+// Saves or loads everything after the header. Both directions walk the same
+// fields in the same order, so a field added here is added to the format.
+static bool snap_state(FILE *f, bool out) {
+    bool ok = snap_io(f, reg, sizeof(reg), out) &&
+              snap_io(f, &running, sizeof(running), out) &&
+              snap_io(f, &free_frames, sizeof(free_frames), out) &&
+              snap_io(f, &bitmap_hint, sizeof(bitmap_hint), out) &&
+              snap_io(f, frame_ref, sizeof(frame_ref), out) &&
+              snap_io(f, shm_regions, sizeof(shm_regions), out) &&
+              snap_io(f, frame_shm, sizeof(frame_shm), out) &&
+              snap_io(f, wait_key, sizeof(wait_key), out);
+
+    // Non-zero pages of mem[] as (page number, contents) records
+    uint16_t page = 0;
+    if (out) {
+        for (uint32_t p = 0; ok && p < MEM_WORDS / PAGE_WORDS; p++) {
+            if (!frame_in_use(p)) {
+                continue;
+            }
+            uint16_t *w = mem + (uint32_t)p * PAGE_WORDS;
+            int i = 0;
+            while (i < PAGE_WORDS && w[i] == 0) {
+                i++;
+            }
+            if (i < PAGE_WORDS) {
+                page = p;
+                ok = snap_io(f, &page, sizeof(page), true) && snap_io(f, w, PAGE_WORDS * sizeof(uint16_t), true);
+            }
+        }
+        page = SNAP_END;
+        ok = ok && snap_io(f, &page, sizeof(page), true);
+    } else {
+        memset(mem, 0, sizeof(mem));
+        memset(frame_seen, 0, sizeof(frame_seen));
+        while ((ok = ok && snap_io(f, &page, sizeof(page), false)) && page != SNAP_END) {
+            ok = page < MEM_WORDS / PAGE_WORDS &&
+                 snap_io(f, mem + (uint32_t)page * PAGE_WORDS, PAGE_WORDS * sizeof(uint16_t), false);
+            if (ok) {
+                frame_seen[page / 16] |= 0x8000 >> (page % 16);
+            }
+        }
+    }
+
+#if defined(VM_PARALLEL) || defined(VM_PREEMPT)
+    ok = ok && snap_io(f, guest_reg, sizeof(guest_reg), out);
+#else
+    ok = ok && snap_io(f, fork_child, sizeof(fork_child), out);
+#endif
+#ifdef VM_PREEMPT
+    ok = ok && snap_io(f, &quantum, sizeof(quantum), out) && snap_io(f, &sched_mlfq, sizeof(sched_mlfq), out) &&
+         snap_io(f, &ticks, sizeof(ticks), out) && snap_io(f, &slice_end, sizeof(slice_end), out) &&
+         snap_io(f, &next_boost, sizeof(next_boost), out) && snap_io(f, proc_level, sizeof(proc_level), out) &&
+         snap_io(f, proc_run, sizeof(proc_run), out) && snap_io(f, proc_wait, sizeof(proc_wait), out) &&
+         snap_io(f, proc_since, sizeof(proc_since), out);
+#endif
+#ifdef VM_RUNQ
+    ok = ok && snap_io(f, rq_next, sizeof(rq_next), out) && snap_io(f, rq_prev, sizeof(rq_prev), out) &&
+         snap_io(f, &rq_head, sizeof(rq_head), out) && snap_io(f, &pcb_free, sizeof(pcb_free), out) &&
+         snap_io(f, pcb_link, sizeof(pcb_link), out);
+#endif
+#ifdef VM_RSS
+    ok = ok && snap_io(f, proc_resident, sizeof(proc_resident), out) &&
+         snap_io(f, proc_reserved, sizeof(proc_reserved), out) &&
+         snap_io(f, proc_rss, sizeof(proc_rss), out) && snap_io(f, proc_rss_peak, sizeof(proc_rss_peak), out);
+#endif
+#ifdef VM_DEMAND
+    ok = ok && snap_io(f, proc_image_size, sizeof(proc_image_size), out);
+    for (int pid = 0; ok && pid < MAX_PROCS; pid++) {
+        ok = snap_str(f, &proc_image[pid][0], out) && snap_str(f, &proc_image[pid][1], out);
+    }
+#endif
+#ifdef VM_SHARE
+    for (int e = 0; ok && e < MAX_PROCS; e++) {
+        code_image *c = &code_images[e];
+        ok = snap_str(f, &c->path, out) && snap_io(f, &c->dev, sizeof(c->dev), out) &&
+             snap_io(f, &c->ino, sizeof(c->ino), out) && snap_io(f, &c->mtime, sizeof(c->mtime), out) &&
+             snap_io(f, &c->bytes, sizeof(c->bytes), out) && snap_io(f, &c->size, sizeof(c->size), out) && snap_io(f, c->pfn, sizeof(c->pfn), out);
+    }
+#endif
+#ifdef VM_SWAP
+    ok = ok && snap_io(f, frame_owner, sizeof(frame_owner), out) &&
+         snap_io(f, frame_age, sizeof(frame_age), out) && snap_io(f, &clock_hand, sizeof(clock_hand), out);
+
+    // Contents of the swapped out pages, by swap slot
+    uint16_t buf[PAGE_WORDS];
+    if (out) {
+        for (uint32_t p = 0; ok && p < MAX_PROCS * VPN_COUNT; p++) {
+            if ((mem[PAGE_PTE(p)] & (PTE_VALID | PTE_SWAPPED)) == PTE_SWAPPED) {
+                page = p;
+                swap_io(page, buf, false);
+                ok = snap_io(f, &page, sizeof(page), true) && snap_io(f, buf, sizeof(buf), true);
+            }
+        }
+        page = SNAP_END;
+        ok = ok && snap_io(f, &page, sizeof(page), true);
+    } else {
+        while ((ok = ok && snap_io(f, &page, sizeof(page), false)) && page != SNAP_END) {
+            ok = page < MAX_PROCS * VPN_COUNT && snap_io(f, buf, sizeof(buf), false);
+            if (ok) {
+                swap_io(page, buf, true);
+            }
+        }
+    }
+#endif
+    return ok;
+}
+
+// Writes the machine state to path. Returns 1 on success, 0 otherwise.
+int vm_snapshot(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (NULL == f) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return 0;
+    }
+    uint16_t header[6] = {SNAP_MAGIC, SNAP_VERSION, PAGE_SHIFT, FRAME_COUNT, MAX_PROCS, snap_features()};
+    bool ok = snap_io(f, header, sizeof(header), true) && snap_state(f, true);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write snapshot %s.\n", path);
+    }
+    return ok;
+}
+
+// Replaces the machine state with the snapshot at path. Returns 1 on success;
+// on failure the machine is left as initOS() sets it up.
+int vm_restore(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (NULL == f) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return 0;
+    }
+    initOS();  // Also resets the caches and the swap file
+    uint16_t header[6];
+    uint16_t expect[6] = {SNAP_MAGIC, SNAP_VERSION, PAGE_SHIFT, FRAME_COUNT, MAX_PROCS, snap_features()};
+    if (!snap_io(f, header, sizeof(header), false) || memcmp(header, expect, sizeof(header)) != 0) {
+        fprintf(stderr, "Snapshot %s was not taken by this VM build.\n", path);
+        fclose(f);
+        return 0;
+    }
+    bool ok = snap_state(f, false);
+    fclose(f);
+    tlb_flush();
+#ifdef VM_DCACHE
+    for (int pfn = 0; pfn < FRAME_COUNT; pfn++) {
+        dcache_invalidate(pfn);
+    }
+#endif
+#ifdef VM_PREEMPT
+    sched_resume = ok && mem[0] != 0xffff;  // Taken mid-run, run() keeps the clock
+#endif
+    if (!ok) {
+        fprintf(stderr, "Snapshot %s is truncated.\n", path);
+        initOS();
+    }
+    return ok;
+}
+
+#ifdef VM_TRACE
+// Execution traces. VM_TRACE=path records the traps, context switches and
+// console input of a run; VM_REPLAY=path runs the same guests again with the
+// input taken from the trace and the console output traps skipped, and stops
+// at the first event that differs. A trace is a header like the snapshot one
+// followed by two-word records: the kind and pid, then a value.
+#define TRACE_MAGIC    (0x5433)  // "T3"
+#define TRACE_VERSION  (1)
+enum { TRACE_TRAP = 1, TRACE_INPUT, TRACE_SWITCH, TRACE_END };
+
+static void trace_init() {
+#ifdef VM_HARNESS
+    return;  // Machines on different threads cannot share one file
+#endif
+    uint16_t header[6] = {TRACE_MAGIC, TRACE_VERSION, PAGE_SHIFT, FRAME_COUNT, MAX_PROCS, snap_features()};
+    char *path = getenv("VM_TRACE");
+    if (path != NULL) {
+        trace_file = fopen(path, "wb");
+        if (NULL == trace_file || !snap_io(trace_file, header, sizeof(header), true)) {
+            fprintf(stderr, "Cannot write trace %s.\n", path);
+            exit(1);
+        }
+        return;
+    }
+    path = getenv("VM_REPLAY");
+    if (path == NULL) {
+        return;
+    }
+    FILE *f = fopen(path, "rb");
+    if (NULL == f) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        exit(1);
+    }
+    uint16_t expect[6];
+    if (!snap_io(f, expect, sizeof(expect), false) || memcmp(header, expect, sizeof(header)) != 0) {
+        fprintf(stderr, "Trace %s was not recorded by this VM build.\n", path);
+        exit(1);
+    }
+    // The whole trace is read up front, replay runs from memory
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    trace_len = (ftell(f) - start) / (2 * sizeof(uint16_t));
+    fseek(f, start, SEEK_SET);
+    trace_buf = malloc((trace_len + 1) * 2 * sizeof(uint16_t));
+    if (!snap_io(f, trace_buf, trace_len * 2 * sizeof(uint16_t), false)) {
+        fprintf(stderr, "Cannot read trace %s.\n", path);
+        exit(1);
+    }
+    fclose(f);
+    trace_pos = 0;
+    trace_diverged = false;
+}
+
+// Records the event, or checks it against the trace and stops the guests at
+// the first one that differs. Returns the value of the record replayed.
+static uint16_t trace_event(uint16_t kind, uint16_t pid, uint16_t value) {
+    uint16_t rec[2] = {(uint16_t)(kind << 12 | pid), value};
+    if (trace_file) {
+        fwrite(rec, sizeof(rec), 1, trace_file);
+        return value;
+    }
+    if (trace_buf == NULL || trace_diverged) {
+        return value;
+    }
+    uint16_t *r = trace_buf + 2 * trace_pos;
+    if (trace_pos < trace_len && r[0] == rec[0] && (kind == TRACE_INPUT || r[1] == rec[1])) {
+        trace_pos++;
+        return r[1];
+    }
+    if (trace_pos < trace_len) {
+        fprintf(stderr, "Replay diverged at record %u: kind %d, pid %d, value %d in the trace, kind %d, pid %d, value %d in the run.\n",
+                trace_pos, r[0] >> 12, r[0] & 0x0fff, r[1], kind, pid, value);
+    } else {
+        fprintf(stderr, "Replay diverged at record %u: the trace ends.\n", trace_pos);
+    }
+    trace_diverged = true;
+    running = 0;
+    return value;
+}
+
+// Runs trap n for the trap table. Input traps take R0 from the trace when
+// replaying; console output is skipped then.
+static void trace_call(int n) {
+    uint16_t pid = CUR_PID;
+    bool input = n == 0 || n == 3 || n == 6;  // GETC, IN, IN_U16
+    trace_event(TRACE_TRAP, pid, n);
+    if (trace_buf && (input || n == 1 || n == 2 || n == 4 || n == 7)) {
+        if (input) {
+            reg[R0] = trace_event(TRACE_INPUT, pid, reg[R0]);
+        }
+        return;
+    }
+    trp_run[n]();
+    if (input) {
+        trace_event(TRACE_INPUT, pid, reg[R0]);
+    }
+}
+
+static void trace_switch(uint16_t from, uint16_t to) {
+    trace_event(TRACE_SWITCH, from, to);
+}
+
+static void trace_finish() {
+    trace_event(TRACE_END, 0, 0);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    if (trace_buf) {
+        if (!trace_diverged) {
+            fprintf(stderr, "Replay: %u records matched.\n", trace_pos);
+        }
+        free(trace_buf);
+        trace_buf = NULL;
+    }
+}
+#endif
+
+#ifdef VM_HARNESS
+// Frees what the machine of the calling thread holds outside its thread-local
+// variables. The harness calls it before a scenario thread exits.
+void vm_release() {
+#ifdef VM_SWAP
+    if (swap_file) {
+        fclose(swap_file);
+        swap_file = NULL;
+    }
+#endif
+    for (int pid = 0; pid < MAX_PROCS; pid++) {
+#ifdef VM_DEMAND
+        free(proc_image[pid][0]);
+        free(proc_image[pid][1]);
+#endif
+#ifdef VM_SHARE
+        free(code_images[pid].path);
+#endif
+#ifdef VM_PROFILE
+        free(prof_pc[pid]);
+#endif
+    }
+#ifdef VM_DCACHE
+    for (int pfn = 0; pfn < FRAME_COUNT; pfn++) {
+        free(dcache[pfn]);
+    }
+#endif
+#ifdef VM_JIT
+    for (int pfn = 0; pfn < FRAME_COUNT; pfn++) {
+        if (jit_code[pfn]) {
+            munmap(jit_code[pfn], JIT_ARENA);
+        }
+    }
+#endif
+}
+#endif
+
+// YOUR CODE STARTS HERE
+
+// This function is used to get file size.
+static uint16_t get_file_size(const char *fname) {
+#ifdef VM_MMAP
+    uint32_t words = img_map(fname)->size;
+    return words > UINT16_MAX ? UINT16_MAX : words;
+#endif
+    FILE *file = fopen(fname, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    long bytes = ftell(file);
+    fclose(file);
+    // Divide by 2 (sizeof(uint16_t)) so ld_img reads
+    // exactly that many 16-bit words, not bytes.
+    if (bytes / (long)sizeof(uint16_t) > UINT16_MAX) {
+        return UINT16_MAX;  // Too large for any segment, createProc() refuses it
+    }
+    return (uint16_t)(bytes / sizeof(uint16_t));
+}
+
+
+#ifdef VM_SHARE
+// Shared code. Every code object in use is remembered by path and file version
+// (device, inode, modification time and size) together with the frames holding
+// its pages, and a process created from the same object maps those frames
+// instead of loading its own copy. Code pages are read-only, so frame_ref alone
+// decides when a frame can go.
+
+// Returns the entry of a code object, adding one if the object is new or its
+// file changed. NULL when the table is full. Nothing is read from the object,
+// code_map() loads the pages that are not resident.
+static code_image *code_read(char *fname) {
+    struct stat st;
+    if (stat(fname, &st) != 0) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        exit(1);
+    }
+
+    code_image *img = NULL;
+    OS_LOCK(frame_lock);
+    for (int e = 0; e < MAX_PROCS; e++) {
+        code_image *c = &code_images[e];
+        if (c->path && c->dev == st.st_dev && c->ino == st.st_ino && c->mtime == st.st_mtime &&
+            c->bytes == st.st_size && strcmp(c->path, fname) == 0) {
+            img = c;
+            break;
+        }
+        if (c->path == NULL && img == NULL) {
+            img = c;  // First unused entry, taken if the object is not found
+        }
+    }
+    if (img && img->path == NULL) {
+        img->path = strcpy(malloc(strlen(fname) + 1), fname);
+        img->dev = st.st_dev;
+        img->ino = st.st_ino;
+        img->mtime = st.st_mtime;
+        img->bytes = st.st_size;
+        img->size = get_file_size(fname);
+        memset(img->pfn, 0, sizeof(img->pfn));
+    }
+    OS_UNLOCK(frame_lock);
+    return img;
+}
+
+// Reads code page p of the object fname, size words long, into the frame pfn
+static void code_load(char *fname, uint16_t size, uint16_t pfn, int p) {
+    uint16_t *dst = mem + FRAME_ADDR(pfn);
+    memset(dst, 0, PAGE_WORDS * sizeof(uint16_t));
+    uint32_t first = (uint32_t)p * PAGE_WORDS;
+    if (first >= size) {
+        return;
+    }
+    uint16_t count = (size - first) > PAGE_WORDS ? PAGE_WORDS : (size - first);
+#ifdef VM_MMAP
+    memcpy(dst, img_map(fname)->words + first, count * sizeof(uint16_t));
+    return;
+#endif
+    FILE *in = fopen(fname, "rb");
+    if (NULL == in) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        exit(1);
+    }
+    fseek(in, first * sizeof(uint16_t), SEEK_SET);
+    fread(dst, sizeof(uint16_t), count, in);
+    fclose(in);
+}
+
+// Maps code page p of img, the object fname, at ptbr, sharing its frame when it
+// is resident and loading it otherwise. Returns the frame, 0 when none is left.
+static uint16_t code_map(code_image *img, char *fname, uint16_t ptbr, int p) {
+    uint16_t vpn = CODE_VPN + p;
+    OS_LOCK(frame_lock);
+    uint16_t pfn = img ? img->pfn[p] : 0;
+    uint16_t a = pfn ? PTE_NEW(ptbr, vpn) : 0;
+    if (a) {
+        frame_ref[pfn]++;
+        mem[a] = (pfn << PTE_PFN_SHIFT) | PTE_READ | PTE_VALID;
+        RSS_NOTE(a);
+        code_shared++;
+        OS_UNLOCK(frame_lock);
+        return pfn;
+    }
+    OS_UNLOCK(frame_lock);
+
+    pfn = map_frame(ptbr, vpn, 0xffff, 0);  // Code is read-only, the PTE may be reserved
+    if (pfn == 0) {
+        return 0;
+    }
+    code_load(fname, img ? img->size : get_file_size(fname), pfn, p);
+    if (img) {
+        OS_LOCK(frame_lock);
+        img->pfn[p] = pfn;
+        OS_UNLOCK(frame_lock);
+    }
+    return pfn;
+}
+
+// Forgets a frame that is going back to the bitmap. Callers hold frame_lock.
+static void code_drop(uint16_t pfn) {
+    for (int e = 0; e < MAX_PROCS; e++) {
+        code_image *c = &code_images[e];
+        if (c->path == NULL) {
+            continue;
+        }
+        bool resident = false;
+        for (int p = 0; p < CODE_SIZE; p++) {
+            if (c->pfn[p] == pfn) {
+                c->pfn[p] = 0;
+            }
+            resident |= c->pfn[p] != 0;
+        }
+        if (!resident) {
+            free(c->path);
+            c->path = NULL;
+        }
+    }
+}
+#endif
+
+#ifdef VM_DEMAND
+// Demand paging. createProc() only reserves the code and heap pages: their
+// PTEs get PTE_LAZY and the permission bits but no frame. The first mr()/mw()
+// touching such a page allocates a frame and loads just that page of the image.
+
+// Brings in the reserved page vpn of the current process and returns its new
+// PTE, or 0 when no frame could be allocated for it.
+static uint16_t page_fault(uint16_t vpn) {
+    uint16_t ptbr = reg[PTBR];
+    uint16_t pte = mem[PTE_ADDR(ptbr, vpn)];
+    uint16_t pid = PT_PID(ptbr);
+    __atomic_fetch_add(&page_faults, 1, __ATOMIC_RELAXED);
+    PROFILE_COUNT(prof_faults, pid);
+
+#ifdef VM_SHARE
+    if (vpn < HEAP_VPN && (pte & PTE_SWAPPED) == 0) {
+        if (code_map(code_read(proc_image[pid][0]), proc_image[pid][0], ptbr, vpn - CODE_VPN) == 0) {
+            return 0;
+        }
+#ifdef VM_SWAP
+        mem[PTE_ADDR(ptbr, vpn)] |= PTE_REF;
+#endif
+        return mem[PTE_ADDR(ptbr, vpn)];
+    }
+#endif
+
+    // A copy-on-write page comes back private, so writable
+    uint16_t frame = map_frame(ptbr, vpn, (pte & PTE_READ) ? 0xffff : 0, (pte & (PTE_WRITE | PTE_COW)) ? 0xffff : 0);
+    if (frame == 0) {
+        return 0;
+    }
+
+#ifdef VM_SWAP
+    // Accessed right away; the swap copy stays valid until the page is dirtied
+    uint16_t a = PTE_ADDR(ptbr, vpn);
+    mem[a] |= PTE_REF;
+    if (pte & PTE_SWAPPED) {
+        swap_io(PAGE_ID(ptbr, vpn), mem + FRAME_ADDR(frame), false);
+        swap_ins++;
+        mem[a] |= PTE_SWAPPED;
+        return mem[a];
+    }
+#endif
+
+    // The frame may hold a previous owner's data, the page starts out zeroed
+    uint16_t *p = mem + FRAME_ADDR(frame);
+    memset(p, 0, PAGE_WORDS * sizeof(uint16_t));
+
+    int seg = vpn >= HEAP_VPN;  // 0 for code, 1 for heap
+    uint32_t first = (uint32_t)(vpn - (seg ? HEAP_VPN : CODE_VPN)) * PAGE_WORDS;
+    uint16_t size = proc_image_size[pid][seg];
+#ifdef VM_MMAP
+    if (first < size) {
+        uint16_t count = (size - first) > PAGE_WORDS ? PAGE_WORDS : (size - first);
+        memcpy(p, img_map(proc_image[pid][seg])->words + first, count * sizeof(uint16_t));
+    }
+    return mem[PTE_ADDR(ptbr, vpn)];
+#endif
+    if (first < size) {
+        FILE *in = fopen(proc_image[pid][seg], "rb");
+        if (NULL == in) {
+            fprintf(stderr, "Cannot open file %s.\n", proc_image[pid][seg]);
+            exit(1);
+        }
+        fseek(in, first * sizeof(uint16_t), SEEK_SET);
+        fread(p, sizeof(uint16_t), (size - first) > PAGE_WORDS ? PAGE_WORDS : (size - first), in);
+        fclose(in);
+    }
+    return mem[PTE_ADDR(ptbr, vpn)];
+}
+#endif
+
+#ifdef VM_SWAP
+// Page replacement. When the bitmap runs dry allocMem() takes the frame of a
+// mapped page instead: the victim is written to the swap file unless it has a
+// clean copy there already, and its PTE keeps only the permissions and
+// PTE_SWAPPED so the next access faults it back in. Every page has a fixed
+// slot in the file, at the offset of its PTE within the page tables.
+
+static void swap_init() {
+    char *policy = getenv("VM_REPLACE");
+    replace_lru = policy && strcmp(policy, "lru") == 0;
+
+    if (swap_file) {
+        fclose(swap_file);
+    }
+#ifdef VM_HARNESS
+    char *path = NULL;  // Machines on different threads cannot share one file
+#else
+    char *path = getenv("VM_SWAPFILE");
+#endif
+    swap_file = path ? fopen(path, "w+b") : tmpfile();
+    if (NULL == swap_file) {
+        fprintf(stderr, "Cannot open the swap file.\n");
+        exit(1);
+    }
+
+    memset(frame_owner, 0, sizeof(frame_owner));
+    memset(frame_age, 0, sizeof(frame_age));
+    clock_hand = 0;
+    swap_ins = evictions = write_backs = 0;
+}
+
+// Moves one page between buf and the swap slot of page
+static void swap_io(uint16_t page, uint16_t *buf, bool out) {
+    fseek(swap_file, (long)page * PAGE_WORDS * sizeof(uint16_t), SEEK_SET);
+    size_t n = out ? fwrite(buf, sizeof(uint16_t), PAGE_WORDS, swap_file)
+                   : fread(buf, sizeof(uint16_t), PAGE_WORDS, swap_file);
+    if (n != PAGE_WORDS) {
+        fprintf(stderr, "Swap file I/O failed for page %d.\n", page);
+        exit(1);
+    }
+}
+
+// Second chance: a referenced frame loses its bit and is passed over once.
+static int pick_clock(int pinned, int keep) {
+    for (int n = 0; n < 2 * FRAME_COUNT; n++) {
+        int f = clock_hand;
+        clock_hand = (clock_hand + 1) % FRAME_COUNT;
+        if (frame_owner[f] == 0 || f == pinned || f == keep) {
+            continue;
+        }
+        if (mem[frame_owner[f]] & PTE_REF) {
+            mem[frame_owner[f]] &= ~PTE_REF;
+            continue;
+        }
+        return f;
+    }
+    return -1;
+}
+
+// LRU approximation: every scan shifts the referenced bit into an 8-bit age
+// and the frame with the lowest age goes. Ages only advance on evictions.
+static int pick_lru(int pinned, int keep) {
+    int victim = -1;
+    for (int f = 0; f < FRAME_COUNT; f++) {
+        if (frame_owner[f] == 0) {
+            continue;
+        }
+        frame_age[f] = (frame_age[f] >> 1) | ((mem[frame_owner[f]] & PTE_REF) ? 0x80 : 0);
+        mem[frame_owner[f]] &= ~PTE_REF;
+        if (f != pinned && f != keep && (victim == -1 || frame_age[f] < frame_age[victim])) {
+            victim = f;
+        }
+    }
+    return victim;
+}
+
+// Unmaps pfn from the PTE at address a. Clean code pages are dropped and come
+// back from the image; anything else is written out unless its copy in the
+// swap file is still current.
+static void swap_unmap(uint16_t a, uint16_t pfn) {
+    uint16_t pte = mem[a];
+    uint16_t perms = pte & (PTE_READ | PTE_WRITE | PTE_COW);
+    uint16_t page = PTE_PAGE(a);
+    uint16_t vpn = page % VPN_COUNT;
+    if (vpn >= CODE_VPN && vpn < HEAP_VPN && (pte & (PTE_WRITE | PTE_COW)) == 0 &&
+        proc_image[page / VPN_COUNT][0] != NULL) {
+        mem[a] = PTE_LAZY | perms;
+        RSS_NOTE(a);
+        return;
+    }
+    if ((pte & PTE_DIRTY) || (pte & PTE_SWAPPED) == 0) {
+        swap_io(page, mem + FRAME_ADDR(pfn), true);
+        write_backs++;
+    }
+    mem[a] = perms | PTE_SWAPPED;
+    RSS_NOTE(a);
+}
+
+// Evicts a page and returns its frame, or -1 when nothing can be evicted.
+// The frame keep is never chosen, pass -1 when any frame may go.
+// Callers hold frame_lock.
+static int swap_out(int keep) {
+    // The frame of the executing instruction stays, its decoded form is in use
+    int pinned = -1;
+    if (reg[PTBR] >= PT_BASE) {
+        uint16_t pte = mem[PTE_ADDR(reg[PTBR], (uint16_t)(reg[RPC] - 1) >> PAGE_SHIFT)];
+        if (pte & PTE_VALID) {
+            pinned = PTE_PFN(pte);
+        }
+    }
+
+    int victim = replace_lru ? pick_lru(pinned, keep) : pick_clock(pinned, keep);
+    tlb_flush();  // Referenced bits were cleared, and the victim's mapping goes
+    if (victim == -1) {
+        return -1;
+    }
+
+    // Every page table sharing the frame loses it, not just the owner
+    swap_unmap(frame_owner[victim], victim);
+    for (; frame_ref[victim] > 0; frame_ref[victim]--) {
+        uint16_t a = frame_rmap(victim);
+        if (a == 0) {
+            break;
+        }
+        swap_unmap(a, victim);
+    }
+    frame_ref[victim] = 0;
+    frame_owner[victim] = 0;
+    evictions++;
+#ifdef VM_SHARE
+    code_drop(victim);
+#endif
+#ifdef VM_DCACHE
+    dcache_invalidate(victim);
+#endif
+    return victim;
+}
+
+// Finds a PTE mapping pfn, the owner of a shared frame when the previous one
+// unmaps it. Returns 0 when no page table maps the frame.
+static uint16_t frame_rmap(uint16_t pfn) {
+    for (uint32_t page = 0; page < MAX_PROCS * VPN_COUNT; page++) {
+        uint16_t a = PAGE_PTE(page);
+        if ((mem[a] & PTE_VALID) && PTE_PFN(mem[a]) == pfn) {
+            return a;
+        }
+    }
+    return 0;
+}
+#endif
 
 void initOS() {
     // Set curProcID to 0xffff, procCount to 0, OSStatus to 0x0000
@@ -161,294 +2689,1276 @@ void initOS() {
     mem[1] = 0x0000;   // procCount
     mem[2] = 0x0000;   // OSStatus
     
-    // Initialize bitmap for free pages (first 3 pages reserved for OS)
-    mem[3] = 0b0001111111111111;  // First 16 pages (3 reserved)
-    mem[4] = 0b1111111111111111;  // Next 16 pages
+    // Initialize bitmap for free pages (first OS_RESERVED pages reserved for OS)
+    for (int w = 0; w < OS_BITMAP_WORDS; w++) {
+        mem[OS_FREE_BITMAP + w] = 0;
+    }
+    for (int f = OS_RESERVED; f < FRAME_COUNT; f++) {
+        mem[OS_FREE_BITMAP + f / 16] |= 0x8000 >> (f % 16);
+    }
+    free_frames = FRAME_COUNT - OS_RESERVED;
+    bitmap_hint = 0;
+    memset(frame_ref, 0, sizeof(frame_ref));
+    memset(shm_regions, 0, sizeof(shm_regions));
+    memset(frame_shm, 0, sizeof(frame_shm));
+    memset(wait_key, 0, sizeof(wait_key));
+#ifdef VM_RUNQ
+    rq_head = pcb_free = 0xffff;
+#endif
+#ifdef VM_RSS
+    memset(proc_resident, 0, sizeof(proc_resident));
+    memset(proc_reserved, 0, sizeof(proc_reserved));
+    memset(proc_rss, 0, sizeof(proc_rss));
+    memset(proc_rss_peak, 0, sizeof(proc_rss_peak));
+#endif
+#ifdef VM_PT2
+    memset(mem + PT_BASE, 0, PT_AREA * sizeof(uint16_t));  // Directories and the free list
+#endif
+#ifdef VM_SWAP
+    swap_init();
+#endif
+#ifdef VM_CONIO
+    memset(con_len, 0, sizeof(con_len));
+    memset(con_blocked, 0, sizeof(con_blocked));
+#endif
 }
 
-uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
-    // Check if page is already allocated
-    if ((mem[ptbr + vpn] & 0x0001) == 1) {
-        printf("Cannot allocate memory for page %d of pid %d since it is already allocated.\n", vpn, mem[0]);
-        return 0;
-    }
-    
-    int16_t found = -1;
-    uint16_t mask = 0b1000000000000000;
-
-    // Search first 16 pages
-    for (int i = 0; i < 16; i++) {
-        if ((mem[3] & mask) >> (15 - i)) {
-            found = i;
-            mem[3] &= ~(0b1 << (15 - i));  // Mark as used
-            break;
+// Claims the lowest free frame with a bit scan of the first non-empty bitmap
+// word and returns it, or -1 when no frame is free. Callers hold frame_lock.
+static int bitmap_alloc() {
+    for (int w = bitmap_hint; w < OS_BITMAP_WORDS; w++) {
+        uint16_t word = mem[OS_FREE_BITMAP + w];
+        if (word != 0) {
+            int bit = __builtin_clz(word) - 16;  // Leading zeros of the 16-bit word
+            mem[OS_FREE_BITMAP + w] = word & ~(0x8000 >> bit);
+            frame_seen[w] |= 0x8000 >> bit;
+            bitmap_hint = w;
+            free_frames--;
+            return w * 16 + bit;
         }
-        mask >>= 1;
     }
+    bitmap_hint = OS_BITMAP_WORDS;
+    return -1;
+}
+
+// Whether frame pfn can hold anything but zeros: the OS frames, allocated
+// frames and freed ones, which keep their old contents. mem[] starts zeroed
+// and nothing writes to a frame that was never allocated.
+int frame_in_use(uint32_t pfn) {
+    uint16_t bit = 0x8000 >> (pfn % 16);
+    return pfn < OS_RESERVED || (frame_seen[pfn / 16] & bit) || (mem[OS_FREE_BITMAP + pfn / 16] & bit) == 0;
+}
+
+// Gives a frame back to the bitmap. Callers hold frame_lock.
+static void bitmap_free(uint16_t pfn) {
+    mem[OS_FREE_BITMAP + pfn / 16] |= 0x8000 >> (pfn % 16);
+    free_frames++;
+    if (pfn / 16 < bitmap_hint) {
+        bitmap_hint = pfn / 16;
+    }
+}
 
-    // If not found, search next 16 pages
-    if (found == -1) {
-        mask = 0b1000000000000000;
-        for (int i = 0; i < 16; i++) {
-            if ((mem[4] & mask) >> (15 - i)) {
-                found = i + 16;
-                mem[4] &= ~(0b1 << (15 - i));  // Mark as used
-                break;
+// Bits of frames first to first + count - 1 that fall in bitmap word w
+static inline uint16_t bitmap_run_mask(int w, int first, int count) {
+    int lo = first > w * 16 ? first - w * 16 : 0;
+    int hi = first + count < (w + 1) * 16 ? first + count - w * 16 : 16;
+    return (uint16_t)(0xffffu << (16 - (hi - lo))) >> lo;
+}
+
+// Claims the lowest run of count contiguous free frames, updating each bitmap
+// word it spans once, and returns its first frame or -1 when there is no such
+// run. Callers hold frame_lock.
+static int bitmap_alloc_run(int count) {
+    int run = 0;
+    for (int f = bitmap_hint * 16; f < FRAME_COUNT; f++) {
+        uint16_t word = mem[OS_FREE_BITMAP + f / 16];
+        if (word == 0) {
+            run = 0;
+            f |= 15;  // Skip the rest of an empty word
+            continue;
+        }
+        run = (word & (0x8000 >> (f % 16))) ? run + 1 : 0;
+        if (run == count) {
+            int first = f - count + 1;
+            for (int w = first / 16; w <= f / 16; w++) {
+                uint16_t mask = bitmap_run_mask(w, first, count);
+                mem[OS_FREE_BITMAP + w] &= ~mask;
+                frame_seen[w] |= mask;
             }
-            mask >>= 1;
+            free_frames -= count;
+            return first;
         }
     }
+    return -1;
+}
+
+// Gives count contiguous frames from first back to the bitmap. Callers hold
+// frame_lock.
+static void bitmap_free_run(int first, int count) {
+    for (int w = first / 16; w <= (first + count - 1) / 16; w++) {
+        mem[OS_FREE_BITMAP + w] |= bitmap_run_mask(w, first, count);
+    }
+    free_frames += count;
+    if (first / 16 < bitmap_hint) {
+        bitmap_hint = first / 16;
+    }
+}
+
+uint16_t allocMem(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
+    // Check if page is already allocated, a reserved or swapped out one counts
+    if (mem[PTE_ADDR(ptbr, vpn)] & PTE_TAKEN) {
+        fprintf(vm_out, "Cannot allocate memory for page %d of pid %d since it is already allocated.\n", vpn, CUR_PID);
+        return 0;
+    }
+    return map_frame(ptbr, vpn, read, write);
+}
+
+// allocMem() without the check, the page faults use it to bring in a page
+// that is reserved or swapped out
+static uint16_t map_frame(uint16_t ptbr, uint16_t vpn, uint16_t read, uint16_t write) {
+    OS_LOCK(frame_lock);
+    uint16_t a = PTE_NEW(ptbr, vpn);
+    int found = a ? bitmap_alloc() : -1;
+#ifdef VM_SWAP
+    if (a && found == -1) {
+        found = swap_out(-1);  // Take a frame from another page, the bitmap stays full
+    }
+    if (found != -1) {
+        frame_owner[found] = (ptbr >= PT_BASE) ? a : 0;
+        frame_age[found] = 0;
+    }
+#endif
 
     if (found != -1) {
         // Create page table entry with appropriate permissions
-        uint16_t entry = (found << 11);
+        uint16_t entry = (found << PTE_PFN_SHIFT);
         
         // Set permission bits
-        if (read == UINT16_MAX) entry |= 0b10;
-        if (write == UINT16_MAX) entry |= 0b100;
-        entry |= 0b1;  // Valid bit
+        if (read == UINT16_MAX) entry |= PTE_READ;
+        if (write == UINT16_MAX) entry |= PTE_WRITE;
+        entry |= PTE_VALID;  // Valid bit
         
         // Update page table entry
-        mem[ptbr + vpn] = entry;
+        mem[a] = entry;
+        RSS_NOTE(a);
         
         // Check if all pages are allocated
-        if (found == 31) {
+        if (free_frames == 0) {
             mem[2] = 0x0001;  // Set OSStatus to indicate full
         }
         
+        OS_UNLOCK(frame_lock);
         return found;
     }
     
     // No free page frames
-    printf("Cannot allocate more space for pid %d since there is no free page frames.\n", mem[0]);
+    OS_UNLOCK(frame_lock);
+    CON_SYNC();
+    fprintf(vm_out, "Cannot allocate more space for pid %d since there is no free page frames.\n", CUR_PID);
     return 0;
 }
 
 int freeMem(uint16_t vpn, uint16_t ptbr) {
+    uint16_t a = PTE_ADDR(ptbr, vpn);
+#ifdef VM_DEMAND
+    // A page that was reserved or swapped out has no frame to give back
+    if ((mem[a] & PTE_VALID) == 0 && (mem[a] & (PTE_LAZY | PTE_SWAPPED))) {
+        mem[a] = 0;
+        RSS_NOTE(a);
+        return 1;
+    }
+#endif
+
     // Check if page is already free
-    if ((mem[ptbr + vpn] & 0x0001) == 0) {
+    if ((mem[a] & PTE_VALID) == 0) {
         return 0;
     }
-    
-    // Get physical frame number
-    uint16_t pfn = mem[ptbr + vpn] >> 11;
+
+    // The mapping is going away, drop any cached copy of it
+    tlb_flush();
     
     // Mark as free in appropriate bitmap
-    if (pfn >= 16) {
-        mem[4] |= (0b1 << (15 - (pfn - 16)));
-    } else {
-        mem[3] |= (0b1 << (15 - pfn));
+    OS_LOCK(frame_lock);
+    int pfn = unmap_frame(a);
+    if (pfn != -1) {
+        bitmap_free(pfn);
+        mem[2] = 0x0000;  // Set OSStatus to indicate space available
     }
-    
-    // Clear valid bit (mark as invalid)
-    mem[ptbr + vpn] &= 0b1111111111111110;
-    
-    // Set OSStatus to indicate space available
-    mem[2] = 0x0000;
+    OS_UNLOCK(frame_lock);
     
     return 1;
 }
+
+// Unmaps the valid page with the PTE at a and returns its frame when no other
+// page table maps it, so it is for the caller to give back. Returns -1 when
+// the frame stays in use. Callers hold frame_lock.
+static int unmap_frame(uint16_t a) {
+    uint16_t pfn = PTE_PFN(mem[a]);
+
+    // Clear valid bit (mark as invalid), a stale swap copy must not be faulted back in
+    mem[a] &= ~(PTE_VALID | PTE_SWAPPED);
+    RSS_NOTE(a);
+    if (frame_ref[pfn] > 0) {
+        // Another process still maps the frame, only this mapping goes
+        frame_ref[pfn]--;
+#ifdef VM_SWAP
+        if (frame_owner[pfn] == a) {
+            frame_owner[pfn] = frame_rmap(pfn);
+        }
+#endif
+        return -1;
+    }
+#ifdef VM_SHARE
+    code_drop(pfn);
+#endif
+#ifdef VM_SWAP
+    frame_owner[pfn] = 0;
+#endif
+#ifdef VM_DCACHE
+    dcache_invalidate(pfn);
+#endif
+    frame_shm[pfn] = false;  // Its region was removed before the last mapping went
+    return pfn;
+}
+
+// Maps count pages from vpn in one go, all of them or none. They get a run of
+// contiguous frames when the bitmap has one, single frames otherwise. Returns
+// the frame of the first page, 0 on failure.
+uint16_t allocRange(uint16_t ptbr, uint16_t vpn, uint16_t count, uint16_t read, uint16_t write) {
+    for (int p = 0; p < count; p++) {
+        if (mem[PTE_ADDR(ptbr, vpn + p)] & PTE_TAKEN) {
+            fprintf(vm_out, "Cannot allocate memory for page %d of pid %d since it is already allocated.\n", vpn + p, CUR_PID);
+            return 0;
+        }
+    }
+
+    OS_LOCK(frame_lock);
+    int frames[VPN_COUNT];
+    int got = 0;
+    bool tables = true;
+    for (int p = 0; p < count; p++) {
+        tables = tables && PTE_NEW(ptbr, vpn + p) != 0;  // Page tables first, they must not split the run
+    }
+    int first = tables ? bitmap_alloc_run(count) : -1;
+    if (first != -1) {
+        for (; got < count; got++) {
+            frames[got] = first + got;
+        }
+    }
+    for (; tables && got < count; got++) {
+        frames[got] = bitmap_alloc();
+#ifdef VM_SWAP
+        if (frames[got] == -1) {
+            frames[got] = swap_out(-1);  // Frames taken so far have no owner yet, they stay
+        }
+#endif
+        if (frames[got] == -1) {
+            break;
+        }
+    }
+    if (got < count) {
+        for (int p = 0; p < got; p++) {
+            bitmap_free(frames[p]);
+        }
+        OS_UNLOCK(frame_lock);
+        CON_SYNC();
+        fprintf(vm_out, "Cannot allocate more space for pid %d since there is no free page frames.\n", CUR_PID);
+        return 0;
+    }
+
+    uint16_t perms = PTE_VALID;
+    if (read == UINT16_MAX) perms |= PTE_READ;
+    if (write == UINT16_MAX) perms |= PTE_WRITE;
+    for (int p = 0; p < count; p++) {
+        uint16_t a = PTE_ADDR(ptbr, vpn + p);
+        mem[a] = (frames[p] << PTE_PFN_SHIFT) | perms;
+        RSS_NOTE(a);
+#ifdef VM_SWAP
+        frame_owner[frames[p]] = (ptbr >= PT_BASE) ? a : 0;
+        frame_age[frames[p]] = 0;
+#endif
+    }
+    if (free_frames == 0) {
+        mem[2] = 0x0001;  // Set OSStatus to indicate full
+    }
+    OS_UNLOCK(frame_lock);
+    return frames[0];
+}
+
+// Unmaps the pages of vpn to vpn + count - 1 that are allocated or reserved.
+// Frames that come back in a contiguous run go to the bitmap together.
+// Returns the number of pages unmapped.
+int freeRange(uint16_t vpn, uint16_t count, uint16_t ptbr) {
+    int freed = 0;
+    int run = -1, run_len = 0;
+    tlb_flush();
+    OS_LOCK(frame_lock);
+    for (int p = 0; p < count; p++) {
+        uint16_t a = PTE_ADDR(ptbr, vpn + p);
+#ifdef VM_DEMAND
+        if ((mem[a] & PTE_VALID) == 0 && (mem[a] & (PTE_LAZY | PTE_SWAPPED))) {
+            mem[a] = 0;
+            RSS_NOTE(a);
+            freed++;
+            continue;
+        }
+#endif
+        if ((mem[a] & PTE_VALID) == 0) {
+            continue;
+        }
+        freed++;
+        int pfn = unmap_frame(a);
+        if (pfn == -1) {
+            continue;
+        }
+        if (run_len > 0 && pfn == run + run_len) {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0) {
+            bitmap_free_run(run, run_len);
+        }
+        run = pfn;
+        run_len = 1;
+    }
+    if (run_len > 0) {
+        bitmap_free_run(run, run_len);
+        mem[2] = 0x0000;
+    }
+    OS_UNLOCK(frame_lock);
+    return freed;
+}
 int createProc(char *fname, char *hname) {
+    OS_LOCK(pcb_lock);
+    int ok = createProcLocked(fname, hname);
+#ifdef VM_RUNQ
+    if (!ok && pcb_free != 0xffff) {
+        mem[PCB_ADDR(pcb_free) + PID_PCB] = 0xffff;  // The reused PCB stays terminated
+    }
+#endif
+    OS_UNLOCK(pcb_lock);
+    return ok;
+}
+
+#ifdef VM_RSS
+// Unmaps every page of pid, whose page table is at ptbr, as freeMem() on each
+// would: one TLB flush and one pass under frame_lock over the pages the masks
+// hold. Freed frames in the same bitmap word go back with a single OR.
+static void rss_release(uint16_t pid, uint16_t ptbr) {
+    tlb_flush();
+    OS_LOCK(frame_lock);
+    int word = -1;
+    uint16_t bits = 0;
+    for (int w = 0; w < RSS_WORDS; w++) {
+        for (uint32_t held = proc_reserved[pid][w]; held; held &= held - 1) {
+            uint16_t a = PTE_ADDR(ptbr, w * 32 + __builtin_ctz(held));
+            mem[a] = 0;
+            RSS_NOTE(a);
+        }
+        for (uint32_t valid = proc_resident[pid][w]; valid; valid &= valid - 1) {
+            int pfn = unmap_frame(PTE_ADDR(ptbr, w * 32 + __builtin_ctz(valid)));
+            if (pfn == -1) {
+                continue;
+            }
+            if (pfn / 16 != word) {
+                if (word != -1) {
+                    mem[OS_FREE_BITMAP + word] |= bits;
+                }
+                word = pfn / 16;
+                bits = 0;
+            }
+            bits |= 0x8000 >> (pfn % 16);
+            free_frames++;
+            if (word < bitmap_hint) {
+                bitmap_hint = word;
+            }
+        }
+    }
+    if (word != -1) {
+        mem[OS_FREE_BITMAP + word] |= bits;
+        mem[2] = 0x0000;  // Set OSStatus to indicate space available
+    }
+    OS_UNLOCK(frame_lock);
+}
+
+// Resident pages of pid, counted as the pages are mapped and unmapped
+uint16_t procRSS(uint16_t pid) {
+    return pid < MAX_PROCS ? proc_rss[pid] : 0;
+}
+#endif
+
+static int createProcLocked(char *fname, char *hname) {
     // Check if OS region is full
     if (mem[2] & 0b1) {
-        printf("The OS memory region is full. Cannot create a new PCB.\n");
+        fprintf(vm_out, "The OS memory region is full. Cannot create a new PCB.\n");
         running = 0;
         return 0;
     }
 
+#ifdef VM_RUNQ
+    uint16_t pid = pcb_take();  // New process ID, a terminated one's if any
+#else
     uint16_t pid = mem[1];  // New process ID
-    uint16_t pcb_index = 12 + pid * 3;
-    uint16_t ptbr = 4096 + pid * 32;  // Page table base register
-
-    // Initialize PCB
-    mem[pcb_index] = pid;  // PID - Store the actual PID directly
-    mem[pcb_index + 1] = 0x3000;  // PC
-    mem[pcb_index + 2] = ptbr;    // PTBR
-
-    // Allocate code and heap segments
-    int16_t code_frame1 = allocMem(ptbr, 6, 0xffff, 0);  // Code is read-only
-    if (code_frame1 == 0) {
-        printf("Cannot create code segment.\n");
+#endif
+    if (pid >= MAX_PROCS) {
+        fprintf(vm_out, "The OS memory region is full. Cannot create a new PCB.\n");
+        running = 0;
         return 0;
     }
-    
-    int16_t code_frame2 = allocMem(ptbr, 7, 0xffff, 0);
-    if (code_frame2 == 0) {
-        freeMem(6, ptbr);
-        printf("Cannot create code segment.\n");
+    uint16_t pcb_index = PCB_ADDR(pid);
+    uint16_t ptbr = PT_ADDR(pid);  // Page table base register
+
+    // An image larger than its segment would spill into frames it does not own
+    uint16_t code_size = get_file_size(fname);
+    uint16_t heap_size = get_file_size(hname);
+    if (code_size > CODE_SIZE * PAGE_WORDS) {
+        fprintf(vm_out, "Cannot create code segment.\n");
         return 0;
     }
-    
-    int16_t heap_frame1 = allocMem(ptbr, 8, 0xffff, 0xffff);  // Heap is read-write
-    if (heap_frame1 == 0) {
-        freeMem(6, ptbr);
-        freeMem(7, ptbr);
-        printf("Cannot create heap segment.\n");
+    if (heap_size > HEAP_INIT_SIZE * PAGE_WORDS) {
+        fprintf(vm_out, "Cannot create heap segment.\n");
         return 0;
     }
-    
-    int16_t heap_frame2 = allocMem(ptbr, 9, 0xffff, 0xffff);
-    if (heap_frame2 == 0) {
-        freeMem(6, ptbr);
-        freeMem(7, ptbr);
-        freeMem(8, ptbr);
-        printf("Cannot create heap segment.\n");
+
+    // Initialize PCB
+    mem[pcb_index + PID_PCB] = pid;  // PID - Store the actual PID directly
+    mem[pcb_index + PC_PCB] = PC_START;  // PC
+    mem[pcb_index + PTBR_PCB] = ptbr;    // PTBR
+
+#ifdef VM_DEMAND
+    // Only reserve the segments, their pages are faulted in on first access
+#ifdef VM_PT2
+    OS_LOCK(frame_lock);
+    bool tables = PTE_NEW(ptbr, CODE_VPN) && PTE_NEW(ptbr, CODE_VPN + CODE_SIZE - 1) &&
+                  PTE_NEW(ptbr, HEAP_VPN) && PTE_NEW(ptbr, HEAP_VPN + HEAP_INIT_SIZE - 1);
+    if (!tables) {
+        pt2_release(ptbr);
+    }
+    OS_UNLOCK(frame_lock);
+    if (!tables) {
+        fprintf(vm_out, "Cannot create code segment.\n");
         return 0;
     }
+#endif
+    for (int p = 0; p < CODE_SIZE; p++) {
+        mem[PTE_ADDR(ptbr, CODE_VPN + p)] = PTE_LAZY | PTE_READ;  // Code is read-only
+        RSS_NOTE(PTE_ADDR(ptbr, CODE_VPN + p));
+    }
+    for (int p = 0; p < HEAP_INIT_SIZE; p++) {
+        mem[PTE_ADDR(ptbr, HEAP_VPN + p)] = PTE_LAZY | PTE_READ | PTE_WRITE;  // Heap is read-write
+        RSS_NOTE(PTE_ADDR(ptbr, HEAP_VPN + p));
+    }
+    free(proc_image[pid][0]);
+    free(proc_image[pid][1]);
+    proc_image_size[pid][0] = code_size;
+    proc_image_size[pid][1] = heap_size;
+    proc_image[pid][0] = strcpy(malloc(strlen(fname) + 1), fname);
+    proc_image[pid][1] = strcpy(malloc(strlen(hname) + 1), hname);
+
+#ifdef VM_RUNQ
+    pcb_commit(pid);
+#else
+    mem[1]++;
+#endif
+    return 1;
+#endif
+
+    // Allocate code and heap segments
+    uint32_t heap_offsets[HEAP_INIT_SIZE];
+#ifdef VM_SHARE
+    code_image *img = code_read(fname);
+#else
+    uint32_t code_offsets[CODE_SIZE];
+#endif
+    for (int p = 0; p < CODE_SIZE; p++) {
+#ifdef VM_SHARE
+        uint16_t frame = code_map(img, fname, ptbr, p);  // Loaded already unless new
+#else
+        uint16_t frame = allocMem(ptbr, CODE_VPN + p, 0xffff, 0);  // Code is read-only
+#endif
+        if (frame == 0) {
+            for (int q = 0; q < p; q++) {
+                freeMem(CODE_VPN + q, ptbr);
+            }
+            fprintf(vm_out, "Cannot create code segment.\n");
+            return 0;
+        }
+#ifndef VM_SHARE
+        code_offsets[p] = FRAME_ADDR(frame);
+#endif
+    }
+
+    for (int p = 0; p < HEAP_INIT_SIZE; p++) {
+        uint16_t frame = allocMem(ptbr, HEAP_VPN + p, 0xffff, 0xffff);  // Heap is read-write
+        if (frame == 0) {
+            for (int q = 0; q < CODE_SIZE + p; q++) {
+                freeMem(CODE_VPN + q, ptbr);
+            }
+            fprintf(vm_out, "Cannot create heap segment.\n");
+            return 0;
+        }
+        heap_offsets[p] = FRAME_ADDR(frame);
+    }
 
     // Load code and heap from files
-    uint16_t code_offsets[2] = {code_frame1 * 2048, code_frame2 * 2048};
-    uint16_t heap_offsets[2] = {heap_frame1 * 2048, heap_frame2 * 2048};
-    uint16_t code_size = get_file_size(fname);
-    uint16_t heap_size = get_file_size(hname);
-    
+#ifndef VM_SHARE
     ld_img(fname, code_offsets, code_size);
+#endif
     ld_img(hname, heap_offsets, heap_size);
     
     // Increment process count
+#ifdef VM_RUNQ
+    pcb_commit(pid);
+#else
     mem[1]++;
+#endif
     return 1;
 }
 
 void loadProc(uint16_t pid) {
+    tlb_flush();
+#ifdef VM_PARALLEL
+    cur_pid = pid;
+#endif
     mem[0] = pid;                      // Set current process ID
-    reg[PTBR] = mem[12 + pid * 3 + 2]; // Load page table base register
-    reg[RPC] = mem[12 + pid * 3 + 1];  // Load program counter
+    reg[PTBR] = mem[PCB_ADDR(pid) + PTBR_PCB]; // Load page table base register
+    reg[RPC] = mem[PCB_ADDR(pid) + PC_PCB];  // Load program counter
+    FORK_IN(pid);
+}
+
+// Write to a copy-on-write page of the current process. The last process
+// mapping the frame takes it over, any other one gets a private copy.
+static uint16_t cow_fault(uint16_t vpn) {
+    uint16_t ptbr = reg[PTBR];
+    uint16_t a = PTE_ADDR(ptbr, vpn);
+    uint16_t pte = mem[a];
+    uint16_t pfn = PTE_PFN(pte);
+    tlb_flush();
+    PROFILE_COUNT(prof_faults, CUR_PID);
+
+    OS_LOCK(frame_lock);
+    if (frame_ref[pfn] > 0) {
+        int found = bitmap_alloc();
+#ifdef VM_SWAP
+        if (found == -1) {
+            found = swap_out(pfn);  // The frame being copied has to stay
+        }
+#endif
+        if (found == -1) {
+            OS_UNLOCK(frame_lock);
+            CON_SYNC();
+            fprintf(vm_out, "Cannot allocate more space for pid %d since there is no free page frames.\n", CUR_PID);
+            return pte;
+        }
+        memcpy(mem + FRAME_ADDR(found), mem + FRAME_ADDR(pfn), PAGE_WORDS * sizeof(uint16_t));
+        frame_ref[pfn]--;
+#ifdef VM_SWAP
+        frame_owner[found] = a;
+        frame_age[found] = 0;
+#endif
+        if (free_frames == 0) {
+            mem[2] = 0x0001;
+        }
+        pte = (found << PTE_PFN_SHIFT) | (pte & (PTE_VALID | PTE_READ));  // The swap copy is not ours
+    }
+    mem[a] = (pte & ~PTE_COW) | PTE_WRITE;
+#ifdef VM_SWAP
+    if (frame_owner[pfn] == a && PTE_PFN(pte) != pfn) {
+        frame_owner[pfn] = frame_rmap(pfn);  // Ownership moves to a remaining sharer
+    }
+#endif
+    OS_UNLOCK(frame_lock);
+    return mem[a];
+}
+
+void tlb_flush() {
+    for (int i = 0; i < TLB_SIZE; i++) {
+        tlb[i].ptbr = 0;
+    }
+}
+
+// Returns the PTE for vpn of the current process, filling the TLB on a miss.
+// Only valid entries are cached so invalid pages always take the slow path.
+static inline uint16_t tlb_lookup(uint16_t vpn) {
+    tlb_entry *e = &tlb[vpn & (TLB_SIZE - 1)];
+    if (e->ptbr == reg[PTBR] && e->vpn == vpn) {
+        tlb_hits++;
+        return e->pte;
+    }
+
+    tlb_misses++;
+    uint16_t a = PTE_ADDR(reg[PTBR], vpn);
+    uint16_t pte = mem[a];
+    if (pte & PTE_VALID) {
+#ifdef VM_SWAP
+        // Hits are not tracked, the replacement scan flushes the TLB after
+        // clearing these so the next access refills and sets them again
+        pte = mem[a] |= PTE_REF;
+#endif
+        e->ptbr = reg[PTBR];
+        e->vpn = vpn;
+        e->pte = pte;
+    }
+    return pte;
 }
 
 static inline uint16_t mr(uint16_t address) {
-    uint16_t vpn = address >> 11;
-    uint16_t offset = address & 0x07FF;  // Lower 11 bits are offset
+    uint16_t vpn = address >> PAGE_SHIFT;
+    uint16_t offset = address & OFFSET_MASK;  // Lower PAGE_SHIFT bits are offset
     
     // Check if address is in reserved region
-    if (vpn <= 5) {
-        printf("Segmentation fault.\n");
+    if (vpn < CODE_VPN) {
+        CON_SYNC();
+        fprintf(vm_out, "Segmentation fault.\n");
         running = 0;
         return -1;
     }
     
     // Check if page is valid
-    uint16_t pte = mem[reg[PTBR] + vpn];
-    if ((pte & 0x0001) == 0) {
-        printf("Segmentation fault inside free space.\n");
+    uint16_t pte = tlb_lookup(vpn);
+#ifdef VM_DEMAND
+    if ((pte & PTE_VALID) == 0 && (pte & (PTE_LAZY | PTE_SWAPPED))) {
+        pte = page_fault(vpn);
+    }
+#endif
+    if ((pte & PTE_VALID) == 0) {
+        CON_SYNC();
+        fprintf(vm_out, "Segmentation fault inside free space.\n");
         running = 0;
         return -1;
     }
     
     // Check read permission
-    if ((pte & 0x0002) == 0) {
-        printf("Cannot read from a write-only page.\n");
+    if ((pte & PTE_READ) == 0) {
+        CON_SYNC();
+        fprintf(vm_out, "Cannot read from a write-only page.\n");
         running = 0;
         return -1;
     }
     
     // Translate address and read value
-    uint16_t pfn = pte >> 11;
-    return mem[(pfn << 11) + offset];
+    uint16_t pfn = PTE_PFN(pte);
+    return mem[FRAME_ADDR(pfn) + offset];
 }
 
 static inline void mw(uint16_t address, uint16_t val) {
-    uint16_t vpn = address >> 11;
-    uint16_t offset = address & 0x07FF;  // Lower 11 bits are offset
+    uint16_t vpn = address >> PAGE_SHIFT;
+    uint16_t offset = address & OFFSET_MASK;  // Lower PAGE_SHIFT bits are offset
     
     // Check if address is in reserved region
-    if (vpn <= 5) {
-        printf("Segmentation fault.\n");
+    if (vpn < CODE_VPN) {
+        CON_SYNC();
+        fprintf(vm_out, "Segmentation fault.\n");
         running = 0;
         return;
     }
     
     // Check if page is valid
-    uint16_t pte = mem[reg[PTBR] + vpn];
-    if ((pte & 0x0001) == 0) {
-        printf("Segmentation fault inside free space.\n");
+    uint16_t pte = tlb_lookup(vpn);
+#ifdef VM_DEMAND
+    if ((pte & PTE_VALID) == 0 && (pte & (PTE_LAZY | PTE_SWAPPED))) {
+        pte = page_fault(vpn);
+    }
+#endif
+    if ((pte & PTE_VALID) == 0) {
+        CON_SYNC();
+        fprintf(vm_out, "Segmentation fault inside free space.\n");
         running = 0;
         return;
     }
     
     // Check write permission
-    if ((pte & 0x0004) == 0) {
-        printf("Cannot write to a read-only page.\n");
+    if ((pte & (PTE_WRITE | PTE_COW)) == PTE_COW) {
+        pte = cow_fault(vpn);
+    }
+    if ((pte & PTE_WRITE) == 0) {
+        CON_SYNC();
+        fprintf(vm_out, "Cannot write to a read-only page.\n");
         running = 0;
         return;
     }
     
+#ifdef VM_SWAP
+    // The first write makes the swap copy stale
+    if ((pte & PTE_DIRTY) == 0) {
+        mem[PTE_ADDR(reg[PTBR], vpn)] |= PTE_DIRTY;
+        tlb_entry *e = &tlb[vpn & (TLB_SIZE - 1)];
+        if (e->ptbr == reg[PTBR] && e->vpn == vpn) {
+            e->pte |= PTE_DIRTY;
+        }
+    }
+#endif
+
     // Translate address and write value
-    uint16_t pfn = pte >> 11;
-    mem[(pfn << 11) + offset] = val;
+    uint16_t pfn = PTE_PFN(pte);
+    mem[FRAME_ADDR(pfn) + offset] = val;
+#ifdef VM_DCACHE
+    dcache_invalidate(pfn);
+#endif
 }
 
 static inline void tbrk() {
+    CON_SYNC();
+    tlb_flush();
     uint16_t address = reg[R0];
-    uint16_t vpn = address >> 11;
+    uint16_t vpn = address >> PAGE_SHIFT;
     uint16_t request = address & 0x0001;  // 1 for allocate, 0 for free
     
     if (request) {
         uint16_t read = (address & 0x0002) ? 0xffff : 0;
         uint16_t write = (address & 0x0004) ? 0xffff : 0;
         
-        printf("Heap increase requested by process %d.\n", mem[0]);
+        fprintf(vm_out, "Heap increase requested by process %d.\n", CUR_PID);
         allocMem(reg[PTBR], vpn, read, write);
     } else {
-        printf("Heap decrease requested by process %d.\n", mem[0]);
+        fprintf(vm_out, "Heap decrease requested by process %d.\n", CUR_PID);
         if (!freeMem(vpn, reg[PTBR])) {
-            printf("Cannot free memory of page %d of pid %d since it is not allocated.\n", vpn, mem[0]);
+            fprintf(vm_out, "Cannot free memory of page %d of pid %d since it is not allocated.\n", vpn, CUR_PID);
+        }
+    }
+}
+
+// Ranged BRK (TRAP x2B). R0 holds the first page and the request bits as for
+// BRK, R1 the number of pages. An increase maps every page or none, a
+// decrease unmaps whichever of them are allocated.
+static inline void tbrkn() {
+    CON_SYNC();
+    tlb_flush();
+    uint16_t address = reg[R0];
+    uint16_t vpn = address >> PAGE_SHIFT;
+    uint16_t count = reg[R1];
+    uint16_t request = address & 0x0001;  // 1 for allocate, 0 for free
+
+    if (count == 0 || vpn + count > VPN_COUNT) {
+        fprintf(vm_out, "Cannot change %d pages from page %d of pid %d since they are outside the address space.\n", count, vpn, CUR_PID);
+        return;
+    }
+    if (request) {
+        uint16_t read = (address & 0x0002) ? 0xffff : 0;
+        uint16_t write = (address & 0x0004) ? 0xffff : 0;
+
+        fprintf(vm_out, "Heap increase of %d pages requested by process %d.\n", count, CUR_PID);
+        allocRange(reg[PTBR], vpn, count, read, write);
+    } else {
+        fprintf(vm_out, "Heap decrease of %d pages requested by process %d.\n", count, CUR_PID);
+        if (freeRange(vpn, count, reg[PTBR]) < count) {
+            fprintf(vm_out, "Cannot free memory of some of pages %d to %d of pid %d since they are not allocated.\n", vpn, vpn + count - 1, CUR_PID);
+        }
+    }
+}
+
+// Gives back the frames of region r that no page maps and drops the key.
+// Callers hold frame_lock.
+static void shm_remove(shm_region *r) {
+    for (int p = 0; p < r->pages; p++) {
+        uint16_t pfn = r->pfn[p];
+        if (frame_ref[pfn] > 0) {
+            frame_ref[pfn]--;  // The last mapping frees it
+        } else {
+            frame_shm[pfn] = false;
+            bitmap_free(pfn);
+            mem[2] = 0x0000;  // Set OSStatus to indicate space available
+        }
+    }
+    r->used = false;
+}
+
+// Shared memory (TRAP x2C). R0 holds the first page and the request bits as
+// for BRK, R1 the key of a region and R2 a number of pages. An allocation maps
+// the first R2 pages of the region at the page with the requested read and
+// write bits, creating it with zeroed frames when no region has the key. A
+// free request removes the key; its frames stay with the pages mapping them
+// and go back to the bitmap with the last one. R0 receives 1 on success.
+static inline void tshm() {
+    CON_SYNC();
+    tlb_flush();
+    uint16_t address = reg[R0];
+    uint16_t vpn = address >> PAGE_SHIFT;
+    uint16_t key = reg[R1];
+    uint16_t count = reg[R2];
+    uint16_t ptbr = reg[PTBR];
+    reg[R0] = 0;
+
+    OS_LOCK(frame_lock);
+    shm_region *r = NULL, *unused = NULL;
+    for (int e = 0; e < SHM_REGIONS; e++) {
+        if (shm_regions[e].used && shm_regions[e].key == key) {
+            r = &shm_regions[e];
+        } else if (!shm_regions[e].used && unused == NULL) {
+            unused = &shm_regions[e];
+        }
+    }
+    if ((address & 0x0001) == 0) {
+        fprintf(vm_out, "Shared region %d removal requested by process %d.\n", key, CUR_PID);
+        if (r == NULL) {
+            OS_UNLOCK(frame_lock);
+            fprintf(vm_out, "Cannot remove shared region %d since it does not exist.\n", key);
+            return;
+        }
+        shm_remove(r);
+        OS_UNLOCK(frame_lock);
+        reg[R0] = 1;
+        return;
+    }
+
+    fprintf(vm_out, "Shared region %d of %d pages requested by process %d.\n", key, count, CUR_PID);
+    if (count == 0 || vpn + count > VPN_COUNT) {
+        OS_UNLOCK(frame_lock);
+        fprintf(vm_out, "Cannot change %d pages from page %d of pid %d since they are outside the address space.\n", count, vpn, CUR_PID);
+        return;
+    }
+    if (r ? count > r->pages : unused == NULL) {
+        OS_UNLOCK(frame_lock);
+        if (r) {
+            fprintf(vm_out, "Cannot map %d pages of shared region %d since it has %d.\n", count, key, r->pages);
+        } else {
+            fprintf(vm_out, "Cannot create shared region %d since every region is in use.\n", key);
+        }
+        return;
+    }
+    for (int p = 0; p < count; p++) {
+        if (mem[PTE_ADDR(ptbr, vpn + p)] & PTE_TAKEN) {
+            OS_UNLOCK(frame_lock);
+            fprintf(vm_out, "Cannot allocate memory for page %d of pid %d since it is already allocated.\n", vpn + p, CUR_PID);
+            return;
+        }
+    }
+    bool tables = true;
+    for (int p = 0; p < count; p++) {
+        tables = tables && PTE_NEW(ptbr, vpn + p) != 0;
+    }
+    if (r == NULL && tables) {
+        r = unused;
+        r->key = key;
+        r->pages = 0;
+        for (; r->pages < count; r->pages++) {
+            int pfn = bitmap_alloc();
+#ifdef VM_SWAP
+            if (pfn == -1) {
+                pfn = swap_out(-1);  // Its frame_owner stays 0, shared frames are never evicted
+            }
+#endif
+            if (pfn == -1) {
+                break;
+            }
+            r->pfn[r->pages] = pfn;
+            frame_shm[pfn] = true;
+            memset(mem + FRAME_ADDR(pfn), 0, PAGE_WORDS * sizeof(uint16_t));
+#ifdef VM_DCACHE
+            dcache_invalidate(pfn);
+#endif
+        }
+        if (r->pages < count) {
+            shm_remove(r);
+            r = NULL;
+        } else {
+            r->used = true;
+        }
+    }
+    if (!tables || r == NULL) {
+        OS_UNLOCK(frame_lock);
+        fprintf(vm_out, "Cannot allocate more space for pid %d since there is no free page frames.\n", CUR_PID);
+        return;
+    }
+
+    uint16_t perms = PTE_VALID;
+    if (address & 0x0002) perms |= PTE_READ;
+    if (address & 0x0004) perms |= PTE_WRITE;
+    for (int p = 0; p < count; p++) {
+        uint16_t a = PTE_ADDR(ptbr, vpn + p);
+        mem[a] = (r->pfn[p] << PTE_PFN_SHIFT) | perms;
+        frame_ref[r->pfn[p]]++;
+        RSS_NOTE(a);
+    }
+    if (free_frames == 0) {
+        mem[2] = 0x0001;  // Set OSStatus to indicate full
+    }
+    OS_UNLOCK(frame_lock);
+    reg[R0] = 1;
+}
+
+// Physical address of the word at address, read first so that a lazy page
+// is brought in. 0 when the read fails.
+static uint32_t phys_word(uint16_t address) {
+    mr(address);
+    if (!running) {
+        return 0;
+    }
+    uint16_t pte = mem[PTE_ADDR(reg[PTBR], address >> PAGE_SHIFT)];
+    return FRAME_ADDR(PTE_PFN(pte)) + (address & OFFSET_MASK);
+}
+
+// Wait (TRAP x2D). Yields and leaves the process out of the round while the
+// word at R0 holds R1, until a NOTIFY on that word. Waits are keyed by the
+// physical word, so processes mapping a shared region at different pages
+// meet. The word is compared in the trap, no NOTIFY can come in between, but
+// a process may still wake for another reason and should check again. R0
+// receives 1 if the process waited, 0 if the word had changed already.
+static inline void twait() {
+    CON_SYNC();
+    uint16_t address = reg[R0];
+    uint32_t key = phys_word(address);
+    if (key == 0) {
+        return;
+    }
+    if (mem[key] != reg[R1]) {
+        reg[R0] = 0;
+        return;
+    }
+    reg[R0] = 1;
+#ifndef VM_PARALLEL
+    // Workers of VM_PARALLEL only yield, the guest is back in the ready queue
+    wait_key[CUR_PID] = key;
+#ifdef VM_RUNQ
+    rq_remove(CUR_PID);
+#endif
+#endif
+    tyld();
+}
+
+// Notify (TRAP x2E). Makes every process waiting on the word at R0 runnable
+// again. R0 receives the number of processes woken.
+static inline void tnotify() {
+    CON_SYNC();
+    uint32_t key = phys_word(reg[R0]);
+    if (key == 0) {
+        return;
+    }
+    uint16_t woken = 0;
+    for (uint16_t pid = 0; pid < mem[Proc_Count]; pid++) {
+        if (wait_key[pid] == key) {
+            wait_key[pid] = 0;
+#ifdef VM_RUNQ
+            rq_insert(pid);
+#endif
+            woken++;
+        }
+    }
+    reg[R0] = woken;
+}
+
+// Checkpoint (TRAP x2F). Writes the machine to the snapshot VM_SNAPSHOT names;
+// VM_RESTORE resumes it right after the trap. R0 receives 1 when the snapshot
+// was written, 0 otherwise. Under VM_PARALLEL the other workers keep running,
+// so no consistent snapshot can be taken and the trap only returns 0.
+static inline void tckpt() {
+    CON_SYNC();
+    char *path = getenv("VM_SNAPSHOT");
+#ifdef VM_PARALLEL
+    path = NULL;
+#endif
+    reg[R0] = 1;  // Saved with the registers, the restored run sees it too
+    if (path == NULL || !vm_snapshot(path)) {
+        reg[R0] = 0;
+    }
+}
+
+// Returns the first runnable process after cur in round-robin order, cur itself
+// being the last candidate, or 0xffff when every process has terminated or
+// waits.
+static uint16_t pick_ready(uint16_t cur) {
+    uint16_t pid = cur;
+#ifdef VM_RUNQ
+    // cur may just have left the ring, its rq_next is still its successor
+#ifdef VM_PREEMPT
+    if (!sched_mlfq)
+#endif
+    return rq_head == 0xffff ? 0xffff : rq_next[cur];
+#endif
+#ifdef VM_PREEMPT
+    if (sched_mlfq) {
+        // Highest priority level first, round-robin inside a level
+        uint16_t best = 0xffff;
+        do {
+            pid = (pid + 1) % mem[1];
+            if (mem[PCB_ADDR(pid) + PID_PCB] != 0xffff && wait_key[pid] == 0 && !CON_WAITS(pid) &&
+                (best == 0xffff || proc_level[pid] < proc_level[best])) {
+                best = pid;
+            }
+        } while (pid != cur);
+        return best;
+    }
+#endif
+    do {
+        pid = (pid + 1) % mem[1];
+        if (mem[PCB_ADDR(pid) + PID_PCB] != 0xffff && wait_key[pid] == 0 && !CON_WAITS(pid)) {
+            return pid;
         }
+    } while (pid != cur);
+    return 0xffff;
+}
+
+// pick_ready(), also waking the processes waiting for console input when some
+// arrived. When nothing else can run and one of them waits, the interpreter
+// blocks on stdin for it.
+static uint16_t pick_next(uint16_t cur) {
+    uint16_t pid = pick_ready(cur);
+#if defined(VM_CONIO) && !defined(VM_PARALLEL)
+    if (con_wake(pid == 0xffff) && pid == 0xffff) {
+#ifdef VM_RUNQ
+        cur = rq_prev[rq_head];  // The ring only holds the woken processes, cur is not in it
+#endif
+        pid = pick_ready(cur);
+    }
+#endif
+    return pid;
+}
+
+#ifdef VM_PREEMPT
+// Accounting and register save of a process leaving the CPU
+static void sched_out(uint16_t pid, bool alive) {
+    proc_run[pid] += ticks - proc_since[pid];
+    proc_since[pid] = ticks;
+    if (alive) {
+        memcpy(guest_reg[pid], reg, sizeof(uint16_t) * RPC);
+        guest_reg[pid][RCND] = reg[RCND];
     }
 }
 
+// Accounting and register restore of a process entering the CPU. PC and PTBR
+// come from its PCB as in the cooperative scheduler.
+static void sched_in(uint16_t pid) {
+    proc_wait[pid] += ticks - proc_since[pid];
+    proc_since[pid] = ticks;
+    memcpy(reg, guest_reg[pid], sizeof(uint16_t) * RPC);
+    reg[RCND] = guest_reg[pid][RCND];
+    slice_end = ticks + ((uint64_t)quantum << (sched_mlfq ? proc_level[pid] : 0));
+}
+#endif
+
 static inline void tyld() {
+    CON_SYNC();
+#ifdef VM_PARALLEL
+    // Save the PC and give the worker back, the guest is re-queued
+    mem[PCB_ADDR(cur_pid) + PC_PCB] = reg[RPC];
+    yielded = true;
+    running = false;
+    PROFILE_COUNT(prof_switches, cur_pid);
+    COUNT_SWITCH();
+#else
     uint16_t old_pid = mem[0];
-    uint16_t new_pid = old_pid;
     
     // Save current process state
-    mem[12 + old_pid * 3 + 1] = reg[RPC];
+    mem[PCB_ADDR(old_pid) + PC_PCB] = reg[RPC];
+    tlb_flush();
+#ifdef VM_PREEMPT
+    sched_out(old_pid, true);
+#endif
     
     // Find next runnable process
-    do {
-        new_pid = (new_pid + 1) % mem[1];
-    } while (mem[12 + new_pid * 3] == 0xffff && new_pid != old_pid);
+    uint16_t new_pid = pick_next(old_pid);
+    if (new_pid == 0xffff) {
+        // Every process waits and none is left to notify them
+        fprintf(vm_out, "Every process is waiting.\n");
+        running = 0;
+        return;
+    }
     
     // Set new process as current
     mem[0] = new_pid;
     
     // Load new process state
-    reg[PTBR] = mem[12 + new_pid * 3 + 2];
-    reg[RPC] = mem[12 + new_pid * 3 + 1];
+#ifdef VM_PREEMPT
+    sched_in(new_pid);
+#endif
+    reg[PTBR] = mem[PCB_ADDR(new_pid) + PTBR_PCB];
+    reg[RPC] = mem[PCB_ADDR(new_pid) + PC_PCB];
+    FORK_IN(new_pid);
     if (old_pid != new_pid) {
-    printf("We are switching from process %d to %d.\n", old_pid, new_pid);
+    fprintf(vm_out, "We are switching from process %d to %d.\n", old_pid, new_pid);
+    PROFILE_COUNT(prof_switches, old_pid);
+    COUNT_SWITCH();
+    TRACE_SWITCH(old_pid, new_pid);
+    }
+#endif
+}
+
+#ifdef VM_PREEMPT
+// Quantum expiry: the same switch as a YIELD, and with the MLFQ policy the
+// process drops one level for having used up its whole slice.
+static void tpreempt() {
+    uint16_t pid = mem[0];
+    if (sched_mlfq) {
+        if (proc_level[pid] < MLFQ_LEVELS - 1) {
+            proc_level[pid]++;
+        }
+        if (ticks >= next_boost) {
+            memset(proc_level, 0, sizeof(proc_level));
+            next_boost = ticks + (uint64_t)quantum * MLFQ_BOOST;
+        }
+    }
+    tyld();
+}
+#endif
+
+// Clones the calling process. The child gets a copy of the PCB and page table
+// and shares every resident frame; writable pages of both become read-only
+// copy-on-write, except those of shared regions. R0 receives the child pid in
+// the parent, or 0xffff when no PCB is left, and 0 in the child.
+static inline void tfork() {
+    CON_SYNC();
+    uint16_t parent = CUR_PID;
+    OS_LOCK(pcb_lock);
+#ifdef VM_RUNQ
+    uint16_t pid = pcb_take();
+#else
+    uint16_t pid = mem[Proc_Count];
+#endif
+    if (pid >= MAX_PROCS) {
+        OS_UNLOCK(pcb_lock);
+        fprintf(vm_out, "The OS memory region is full. Cannot create a new PCB.\n");
+        reg[R0] = 0xffff;
+        return;
+    }
+
+    uint16_t src = reg[PTBR];
+    uint16_t ptbr = PT_ADDR(pid);
+    OS_LOCK(frame_lock);
+#ifdef VM_PT2
+    // The child gets a second-level table wherever the parent has one
+    for (int d = 0; d < PT_DIR_SIZE; d++) {
+        if (mem[src + d] && PTE_NEW(ptbr, d * PT2_ENTRIES) == 0) {
+            pt2_release(ptbr);
+            OS_UNLOCK(frame_lock);
+            OS_UNLOCK(pcb_lock);
+            fprintf(vm_out, "Cannot allocate more space for pid %d since there is no free page frames.\n", parent);
+            reg[R0] = 0xffff;
+            return;
+        }
+    }
+#endif
+    for (int vpn = 0; vpn < VPN_COUNT; vpn++) {
+        uint16_t pte = mem[PTE_ADDR(src, vpn)];
+        if (pte & PTE_VALID) {
+            if ((pte & PTE_WRITE) && !frame_shm[PTE_PFN(pte)]) {
+                pte = (pte & ~PTE_WRITE) | PTE_COW;
+                mem[PTE_ADDR(src, vpn)] = pte;
+            }
+            frame_ref[PTE_PFN(pte)]++;
+            pte &= ~PTE_SWAPPED;  // The parent's swap slot is not the child's
+        }
+#ifdef VM_SWAP
+        else if (pte & PTE_SWAPPED) {
+            uint16_t buf[PAGE_WORDS];
+            swap_io(PAGE_ID(src, vpn), buf, false);
+            swap_io(PAGE_ID(ptbr, vpn), buf, true);
+        }
+#endif
+        mem[PTE_ADDR(ptbr, vpn)] = pte;
+        RSS_NOTE(PTE_ADDR(ptbr, vpn));
+    }
+    OS_UNLOCK(frame_lock);
+    tlb_flush();
+
+#ifdef VM_DEMAND
+    for (int seg = 0; seg < 2; seg++) {
+        free(proc_image[pid][seg]);
+        proc_image[pid][seg] = NULL;
+        if (proc_image[parent][seg]) {
+            proc_image[pid][seg] = strcpy(malloc(strlen(proc_image[parent][seg]) + 1), proc_image[parent][seg]);
+        }
+        proc_image_size[pid][seg] = proc_image_size[parent][seg];
     }
+#endif
+
+    mem[PCB_ADDR(pid) + PID_PCB] = pid;
+    mem[PCB_ADDR(pid) + PC_PCB] = reg[RPC];  // Both continue after the trap
+    mem[PCB_ADDR(pid) + PTBR_PCB] = ptbr;
+#ifdef VM_RUNQ
+    pcb_commit(pid);
+#else
+    mem[Proc_Count]++;
+#endif
+    OS_UNLOCK(pcb_lock);
+    fprintf(vm_out, "Process %d forked process %d.\n", parent, pid);
+
+#if defined(VM_PARALLEL) || defined(VM_PREEMPT)
+    memcpy(guest_reg[pid], reg, sizeof(reg));
+    guest_reg[pid][R0] = 0;
+#else
+    fork_child[pid] = true;
+#endif
+#ifdef VM_PREEMPT
+    proc_level[pid] = 0;
+    proc_run[pid] = proc_wait[pid] = 0;
+    proc_since[pid] = ticks;
+#endif
+#ifdef VM_PARALLEL
+    pthread_mutex_lock(&sched_lock);
+    ready_q[(ready_head + ready_count) % MAX_PROCS] = pid;
+    ready_count++;
+    live_procs++;
+    pthread_cond_broadcast(&sched_cv);
+    pthread_mutex_unlock(&sched_lock);
+#endif
+    reg[R0] = pid;
 }
 
 static inline void thalt() {
-    uint16_t current_pid = mem[0];
-    uint16_t next_pid = current_pid;
+    CON_SYNC();
+    uint16_t current_pid = CUR_PID;
     
     // Mark current process as terminated
-    mem[12 + current_pid * 3] = 0xffff;
+    mem[PCB_ADDR(current_pid) + PID_PCB] = 0xffff;
+    tlb_flush();
     
     // Free all pages allocated to current process
-    uint16_t ptbr = mem[12 + current_pid * 3 + 2];
-    for (int i = 0; i < 32; i++) {
-        if (mem[ptbr + i] & 0x0001) {
+    uint16_t ptbr = mem[PCB_ADDR(current_pid) + PTBR_PCB];
+#ifdef VM_RSS
+    rss_release(current_pid, ptbr);
+#else
+    for (int i = 0; i < VPN_COUNT; i++) {
+        if (mem[PTE_ADDR(ptbr, i)] & (PTE_VALID | PTE_LAZY | PTE_SWAPPED)) {
             freeMem(i, ptbr);
         }
     }
+#endif
+#ifdef VM_PT2
+    OS_LOCK(frame_lock);
+    pt2_release(ptbr);
+    OS_UNLOCK(frame_lock);
+#endif
+#ifdef VM_RUNQ
+    // The PCB and its page table go to the next process created
+    rq_remove(current_pid);
+    pcb_link[current_pid] = pcb_free;
+    pcb_free = current_pid;
+#endif
+
+#ifdef VM_PARALLEL
+    // The worker picks the next guest from the ready queue
+    running = 0;
+    return;
+#endif
+#ifdef VM_PREEMPT
+    sched_out(current_pid, false);
+#endif
     
     // Find next runnable process
-    do {
-        next_pid = (next_pid + 1) % mem[1];
-        if (next_pid == current_pid) {
-            // No more runnable processes
-            running = 0;
-            return;
+    uint16_t next_pid = pick_next(current_pid);
+    if (next_pid == 0xffff) {
+        // No more runnable processes, the ones left wait for a NOTIFY nobody can send
+        for (uint16_t pid = 0; pid < mem[Proc_Count]; pid++) {
+            if (mem[PCB_ADDR(pid) + PID_PCB] != 0xffff) {
+                fprintf(vm_out, "Every process is waiting.\n");
+                break;
+            }
         }
-    } while (mem[12 + next_pid * 3] == 0xffff);
+        running = 0;
+        return;
+    }
+    PROFILE_COUNT(prof_switches, current_pid);
+    COUNT_SWITCH();
+    TRACE_SWITCH(current_pid, next_pid);
     
     // Set next process as current and load its state
+#ifdef VM_PREEMPT
+    sched_in(next_pid);
+#endif
     mem[0] = next_pid;
-    reg[PTBR] = mem[12 + next_pid * 3 + 2];
-    reg[RPC] = mem[12 + next_pid * 3 + 1];
+    reg[PTBR] = mem[PCB_ADDR(next_pid) + PTBR_PCB];
+    reg[RPC] = mem[PCB_ADDR(next_pid) + PC_PCB];
+    FORK_IN(next_pid);
 }
 
 // YOUR CODE ENDS HERE
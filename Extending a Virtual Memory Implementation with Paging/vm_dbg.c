@@ -1,12 +1,56 @@
 // DEBUG
-void fprintf_binary(FILE *f, uint16_t num) {
-    int c = 16;
-    while(c-->0) {
-        if ((c+1)%4==0) {
-            fprintf(f, " ");
-        }
-        fprintf(f, "%d", (num>>c)&1);
+#define DUMP_BUF (1 << 16)  // Bytes rendered before a dump is written out
+
+// Binary digits of each nibble, with the space that goes in front of it
+static const char bin_nibble[16][5] = {
+    " 0000", " 0001", " 0010", " 0011", " 0100", " 0101", " 0110", " 0111",
+    " 1000", " 1001", " 1010", " 1011", " 1100", " 1101", " 1110", " 1111"
+};
+
+static char *sprint_binary(char *p, uint16_t num) {
+    for (int c = 12; c >= 0; c -= 4) {
+        memcpy(p, bin_nibble[(num >> c) & 0xf], 5);
+        p += 5;
+    }
+    return p;
+}
+
+static char *sprint_dec(char *p, uint32_t num) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + num % 10;
+        num /= 10;
+    } while (num);
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+// The line fprintf_mem_nonzero() prints for mem[i]
+static char *sprint_mem_word(char *p, uint32_t i, uint16_t w) {
+    static const char hex[] = "0123456789abcdef";
+    memcpy(p, "mem[", 4);
+    p = sprint_dec(p + 4, i);
+    memcpy(p, "|0x", 3);
+    p += 3;
+    for (int c = 12; c >= 0; c -= 4) {
+        *p++ = hex[(i >> c) & 0xf];
     }
+    *p++ = ']';
+    *p++ = '=';
+    p = sprint_binary(p, w);
+    memcpy(p, " (dec: ", 7);
+    p = sprint_dec(p + 7, w);
+    *p++ = ')';
+    *p++ = '\n';
+    return p;
+}
+
+void fprintf_binary(FILE *f, uint16_t num) {
+    char buf[20];
+    fwrite(buf, 1, sprint_binary(buf, num) - buf, f);
 }
 
 void fprintf_inst(FILE *f, uint16_t instr) {
@@ -23,19 +67,36 @@ void fprintf_mem(FILE *f, uint16_t *mem, uint16_t from, uint16_t to) {
     }
 }
 
-void fprintf_mem_nonzero(FILE *f, uint16_t *mem, uint32_t stop) {
-    for(int i = 0; i < stop; i++) {
-        if (mem[i]!=0) {
-            fprintf(f, "mem[%d|0x%.04x]=", i, i);
-            fprintf_binary(f, mem[i]);
-            fprintf (f," (dec: %d)", mem[i]);
-            fprintf(f, "\n"); 
+// fprintf_mem_nonzero() that skips every page_words long page for which
+// in_use returns 0, e.g. frames that were never allocated. A NULL in_use
+// scans them all.
+void fprintf_mem_pages(FILE *f, uint16_t *mem, uint32_t stop, uint32_t page_words, int (*in_use)(uint32_t page)) {
+    static _Thread_local char buf[DUMP_BUF];  // Too large for the stack, one per harness thread
+    char *p = buf;
+    for (uint32_t page = 0; page * page_words < stop; page++) {
+        if (in_use && !in_use(page)) {
+            continue;
+        }
+        uint32_t end = (page + 1) * page_words < stop ? (page + 1) * page_words : stop;
+        for (uint32_t i = page * page_words; i < end; i++) {
+            if (mem[i] != 0) {
+                if (p - buf > DUMP_BUF - 64) {  // Room for the longest line
+                    fwrite(buf, 1, p - buf, f);
+                    p = buf;
+                }
+                p = sprint_mem_word(p, i, mem[i]);
+            }
         }
     }
+    fwrite(buf, 1, p - buf, f);
+}
+
+void fprintf_mem_nonzero(FILE *f, uint16_t *mem, uint32_t stop) {
+    fprintf_mem_pages(f, mem, stop, stop ? stop : 1, NULL);
 }
 
 void fprintf_reg(FILE *f, uint16_t *reg, int idx) {
-    fprintf(stdout, "reg[%d]=0x%.04x\n", idx, reg[idx]);
+    fprintf(f, "reg[%d]=0x%.04x\n", idx, reg[idx]);
 }
 
 void fprintf_reg_all(FILE *f, uint16_t *reg, int size) {